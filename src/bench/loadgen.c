@@ -0,0 +1,431 @@
+/* A small HTTP load generator for the bench target.
+ *
+ * It keeps "concurrency" connections busy for a number of seconds using
+ * a single epoll loop and prints one JSON object per run. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HDR_BUF_SIZE 8192
+#define MAX_EVENTS 256
+
+enum state { ST_CONNECTING, ST_SENDING, ST_HEADER, ST_BODY };
+
+struct client
+{
+    int fd;
+    enum state st;
+    size_t sent;
+    size_t hlen;
+    long long left;     // body bytes still expected, -1 if unknown
+    int keep_alive;
+    double start;
+    char hdr[HDR_BUF_SIZE];
+};
+
+static struct opts
+{
+    const char* host;
+    const char* port;
+    const char* path;
+    const char* label;
+    const char* header;
+    int concurrency;
+    double duration;
+    int keep_alive;
+} g_opts = {"127.0.0.1", "8080", "/", "run", NULL, 16, 5.0, 0};
+
+static struct stats
+{
+    long long requests;
+    long long errors;
+    long long non2xx;
+    long long bytes;
+    long long body_bytes;
+    uint32_t* lat;      // microseconds
+    size_t nlat;
+    size_t caplat;
+} g_stats;
+
+static int g_epfd;
+static struct addrinfo* g_addr;
+static char g_req[1024];
+static size_t g_reqlen;
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+record_latency(double sec)
+{
+    if(g_stats.nlat == g_stats.caplat)
+    {
+        size_t cap = g_stats.caplat ? 2 * g_stats.caplat : 65536;
+        uint32_t* p = realloc(g_stats.lat, cap * sizeof(*p));
+        if(NULL == p)
+            return;
+        g_stats.lat = p;
+        g_stats.caplat = cap;
+    }
+    g_stats.lat[g_stats.nlat++] = (uint32_t) (sec * 1e6);
+}
+
+static void
+watch(struct client* c, int op, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(g_epfd, op, c->fd, &ev);
+}
+
+static int
+start_connection(struct client* c)
+{
+    c->fd = socket(g_addr->ai_family, g_addr->ai_socktype | SOCK_NONBLOCK,
+            g_addr->ai_protocol);
+    if(-1 == c->fd)
+    {
+        perror("[loadgen] socket");
+        return -1;
+    }
+    if(-1 == connect(c->fd, g_addr->ai_addr, g_addr->ai_addrlen)
+            && EINPROGRESS != errno)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->st = ST_CONNECTING;
+    c->sent = 0;
+    c->hlen = 0;
+    c->start = now();
+    watch(c, EPOLL_CTL_ADD, EPOLLOUT);
+    return 0;
+}
+
+static void
+start_request(struct client* c)
+{
+    c->st = ST_SENDING;
+    c->sent = 0;
+    c->hlen = 0;
+    c->start = now();
+}
+
+/** Closes the connection and opens a new one, so the load stays constant */
+static void
+drop_connection(struct client* c, int failed, double deadline)
+{
+    if(failed)
+        ++g_stats.errors;
+    close(c->fd);
+    c->fd = -1;
+    if(now() < deadline)
+        start_connection(c);
+}
+
+static int
+parse_header(struct client* c, char* end)
+{
+    char* p;
+    int status;
+
+    *end = '\0';
+    if(1 != sscanf(c->hdr, "HTTP/%*d.%*d %d", &status))
+        return -1;
+    if(status < 200 || status > 299)
+        ++g_stats.non2xx;
+
+    c->left = -1;
+    c->keep_alive = 0;
+    for(p = strstr(c->hdr, "\r\n"); NULL != p; p = strstr(p, "\r\n"))
+    {
+        p += 2;
+        if(0 == strncasecmp(p, "Content-Length:", 15))
+            c->left = strtoll(p + 15, NULL, 10);
+        else if(0 == strncasecmp(p, "Connection:", 11))
+            c->keep_alive = NULL != strcasestr(p, "keep-alive")
+                && strcasestr(p, "keep-alive") < strstr(p, "\r\n");
+    }
+    if(304 == status || 204 == status)
+        c->left = 0;
+    return 0;
+}
+
+static void
+finish_request(struct client* c, double deadline)
+{
+    ++g_stats.requests;
+    record_latency(now() - c->start);
+
+    if(g_opts.keep_alive && c->keep_alive && now() < deadline)
+    {
+        start_request(c);
+        watch(c, EPOLL_CTL_MOD, EPOLLOUT);
+        return;
+    }
+    drop_connection(c, 0, deadline);
+}
+
+static void
+on_event(struct client* c, double deadline)
+{
+    char buf[65536];
+    ssize_t n;
+    int err;
+    socklen_t len = sizeof(err);
+
+    switch(c->st)
+    {
+        case ST_CONNECTING:
+            if(0 != getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len)
+                    || 0 != err)
+            {
+                drop_connection(c, 1, deadline);
+                return;
+            }
+            c->st = ST_SENDING;
+            // fall through
+        case ST_SENDING:
+            n = send(c->fd, g_req + c->sent, g_reqlen - c->sent, MSG_NOSIGNAL);
+            if(-1 == n)
+            {
+                if(EAGAIN != errno)
+                    drop_connection(c, 1, deadline);
+                return;
+            }
+            c->sent += n;
+            if(c->sent == g_reqlen)
+            {
+                c->st = ST_HEADER;
+                watch(c, EPOLL_CTL_MOD, EPOLLIN);
+            }
+            return;
+        case ST_HEADER:
+        case ST_BODY:
+            break;
+    }
+
+    while(1)
+    {
+        char* data = buf;
+        size_t room = sizeof(buf);
+
+        if(ST_HEADER == c->st)
+        {
+            data = c->hdr + c->hlen;
+            room = sizeof(c->hdr) - 1 - c->hlen;
+        }
+        n = recv(c->fd, data, room, 0);
+        if(-1 == n)
+        {
+            if(EAGAIN != errno)
+                drop_connection(c, 1, deadline);
+            return;
+        }
+        if(0 == n)
+        {
+            // a response without Content-Length ends with the connection
+            if(ST_BODY == c->st && -1 == c->left)
+            {
+                c->keep_alive = 0;
+                finish_request(c, deadline);
+            }
+            else
+            {
+                drop_connection(c, 1, deadline);
+            }
+            return;
+        }
+        g_stats.bytes += n;
+
+        if(ST_HEADER == c->st)
+        {
+            char* end;
+            c->hlen += n;
+            c->hdr[c->hlen] = '\0';
+            if(NULL == (end = strstr(c->hdr, "\r\n\r\n")))
+            {
+                if(c->hlen < sizeof(c->hdr) - 1)
+                    continue;
+                drop_connection(c, 1, deadline);
+                return;
+            }
+            size_t body = c->hlen - (end + 4 - c->hdr);
+            if(-1 == parse_header(c, end))
+            {
+                drop_connection(c, 1, deadline);
+                return;
+            }
+            c->st = ST_BODY;
+            n = body;
+        }
+
+        g_stats.body_bytes += n;
+        if(-1 != c->left)
+        {
+            c->left -= n;
+            if(c->left <= 0)
+            {
+                finish_request(c, deadline);
+                return;
+            }
+        }
+    }
+}
+
+static int
+cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t
+percentile(double q)
+{
+    size_t i;
+
+    if(0 == g_stats.nlat)
+        return 0;
+    i = (size_t) (q * (g_stats.nlat - 1) + 0.5);
+    return g_stats.lat[i];
+}
+
+static void
+usage()
+{
+    fprintf(stderr,
+"Usage: loadgen [options]\n"
+"-H host      : Server address (default: 127.0.0.1)\n"
+"-p port      : Server port (default: 8080)\n"
+"-u path      : Request URI (default: /)\n"
+"-c n         : Number of concurrent connections (default: 16)\n"
+"-d seconds   : Duration of the run (default: 5)\n"
+"-k           : Reuse connections (keep-alive)\n"
+"-a header    : Add a request header, e.g. \"Accept-Encoding: gzip\"\n"
+"-l label     : A label for the report\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    int i;
+    int opt;
+    int status;
+    double start;
+    double deadline;
+    struct addrinfo hints;
+    struct client* clients;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(-1 != (opt = getopt(argc, argv, "H:p:u:c:d:ka:l:h")))
+    {
+        switch(opt)
+        {
+            case 'H': g_opts.host = optarg; break;
+            case 'p': g_opts.port = optarg; break;
+            case 'u': g_opts.path = optarg; break;
+            case 'c': g_opts.concurrency = atoi(optarg); break;
+            case 'd': g_opts.duration = atof(optarg); break;
+            case 'k': g_opts.keep_alive = 1; break;
+            case 'a': g_opts.header = optarg; break;
+            case 'l': g_opts.label = optarg; break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+    if(g_opts.concurrency <= 0 || g_opts.duration <= 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(0 != (status = getaddrinfo(g_opts.host, g_opts.port, &hints, &g_addr)))
+    {
+        fprintf(stderr, "[loadgen] getaddrinfo: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+    g_reqlen = snprintf(g_req, sizeof(g_req),
+            "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n",
+            g_opts.path, g_opts.host,
+            g_opts.keep_alive ? "" : "Connection: close\r\n",
+            g_opts.header ? g_opts.header : "",
+            g_opts.header ? "\r\n" : "");
+
+    if(-1 == (g_epfd = epoll_create1(0))
+            || NULL == (clients = calloc(g_opts.concurrency, sizeof(*clients))))
+    {
+        perror("[loadgen] init");
+        return EXIT_FAILURE;
+    }
+
+    start = now();
+    deadline = start + g_opts.duration;
+    for(i = 0; i < g_opts.concurrency; ++i)
+    {
+        start_connection(&clients[i]);
+    }
+
+    while(now() < deadline)
+    {
+        int nev = epoll_wait(g_epfd, events, MAX_EVENTS, 100);
+        for(i = 0; i < nev; ++i)
+        {
+            struct client* c = events[i].data.ptr;
+            if(-1 != c->fd)
+                on_event(c, deadline);
+        }
+    }
+    double elapsed = now() - start;
+
+    qsort(g_stats.lat, g_stats.nlat, sizeof(*g_stats.lat), cmp_u32);
+    printf("{\"label\": \"%s\", \"path\": \"%s\", \"concurrency\": %d, "
+            "\"keepalive\": %s, \"seconds\": %.3f, \"requests\": %lld, "
+            "\"errors\": %lld, \"non2xx\": %lld, \"rps\": %.1f, "
+            "\"bytes\": %lld, \"body_bytes\": %lld, \"mb_per_sec\": %.2f, "
+            "\"p50_us\": %u, \"p99_us\": %u, \"p999_us\": %u, "
+            "\"max_us\": %u}\n",
+            g_opts.label, g_opts.path, g_opts.concurrency,
+            g_opts.keep_alive ? "true" : "false", elapsed,
+            g_stats.requests, g_stats.errors, g_stats.non2xx,
+            g_stats.requests / elapsed, g_stats.bytes, g_stats.body_bytes,
+            g_stats.bytes / elapsed / (1024.0 * 1024.0),
+            percentile(0.50), percentile(0.99), percentile(0.999),
+            g_stats.nlat ? g_stats.lat[g_stats.nlat - 1] : 0);
+
+    for(i = 0; i < g_opts.concurrency; ++i)
+    {
+        if(-1 != clients[i].fd)
+            close(clients[i].fd);
+    }
+    free(clients);
+    free(g_stats.lat);
+    freeaddrinfo(g_addr);
+    close(g_epfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+#!/bin/sh
+# Runs the load generator against a freshly started server on loopback.
+#
+# Every run prints one JSON object per line, so two builds can be compared
+# with any JSON-aware tool. Environment variables:
+#   BENCH_PORT         - port of the server (default: 8088)
+#   BENCH_DURATION     - seconds per run (default: 5)
+#   BENCH_CONCURRENCY  - space-separated concurrency levels (default: 1 16 256)
+#   BENCH_OUT          - a file the results are appended to (optional)
+#   BENCH_SERVER_OPTS  - additional options for the server
+#   BENCH_MODE         - "files" measures plain files (default), "gzip"
+#                        compares on-the-fly compression levels of a text
+#                        file against no compression; those runs also
+#                        report the CPU time the server spent on them (add
+#                        --cache-size 0 to BENCH_SERVER_OPTS to compress
+#                        on every request instead of once per worker)
+#   BENCH_GZIP_LEVELS  - compression levels for the gzip mode (default: 1 6 9)
+
+BINDIR=${BINDIR:-../bin}
+PORT=${BENCH_PORT:-8088}
+DURATION=${BENCH_DURATION:-5}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 16 256"}
+MODE=${BENCH_MODE:-files}
+GZIP_LEVELS=${BENCH_GZIP_LEVELS:-"1 6 9"}
+
+ROOT=$(mktemp -d /tmp/webserver-bench.XXXXXX)
+LOG=$ROOT.log
+trap 'stop_server; rm -rf "$ROOT" "$LOG"' EXIT INT TERM
+
+stop_server() {
+    if [ -n "$MANAGER" ]; then
+        kill "$MANAGER" 2>/dev/null
+        MANAGER=
+    fi
+}
+
+start_server() {
+    "$BINDIR/webserver" -r "$ROOT" --port "$PORT" --log "$LOG" \
+        $BENCH_SERVER_OPTS "$@" || exit 1
+
+    # the daemon reports its pid as "[manager] <pid> <server pid>"
+    i=0
+    while [ -z "$MANAGER" ] && [ $i -lt 50 ]; do
+        MANAGER=$(sed -n 's/^\[manager\] \([0-9]*\) [0-9]*$/\1/p' "$LOG" 2>/dev/null)
+        i=$((i + 1))
+        sleep 0.1
+    done
+    if [ -z "$MANAGER" ]; then
+        echo "[bench] the server did not start:" >&2
+        cat "$LOG" >&2
+        exit 1
+    fi
+    # the daemon forks twice, so the group is not led by the manager
+    PGROUP=$(awk '{ print $5 }' "/proc/$MANAGER/stat")
+    : > "$LOG"
+    sleep 0.5
+}
+
+# user + system time of the processes of the benchmarked server in clock
+# ticks, not of other instances on the host
+cpu_ticks() {
+    total=0
+    for pid in $(pgrep -g "$PGROUP" -x webserver); do
+        t=$(awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null)
+        total=$((total + ${t:-0}))
+    done
+    echo $total
+}
+
+head -c 1024 /dev/urandom > "$ROOT/small.bin"
+head -c $((1024 * 1024)) /dev/urandom > "$ROOT/large.bin"
+echo "<html><body><h1>index</h1></body></html>" > "$ROOT/index.html"
+# a stylesheet-like text file of about 100 KiB
+awk 'BEGIN { srand(1); for(i = 0; i < 2500; ++i)
+    printf(".c%d { margin: %dpx %dpx; color: #%06x; }\n",
+        i, rand() * 64, rand() * 64, rand() * 16777215) }' > "$ROOT/text.css"
+
+if [ "$MODE" = gzip ]; then
+    hz=$(getconf CLK_TCK)
+    for level in off $GZIP_LEVELS; do
+        if [ "$level" = off ]; then
+            start_server --gzip off
+        else
+            start_server --gzip on --gzip-level "$level"
+        fi
+        for c in $CONCURRENCY; do
+            before=$(cpu_ticks)
+            out=$("$BINDIR/loadgen" -p "$PORT" -u /text.css -c "$c" \
+                -d "$DURATION" -k -a "Accept-Encoding: gzip" \
+                -l "gzip-$level-c$c")
+            after=$(cpu_ticks)
+            requests=$(echo "$out" | sed -n 's/.*"requests": \([0-9]*\).*/\1/p')
+            body=$(echo "$out" | sed -n 's/.*"body_bytes": \([0-9]*\).*/\1/p')
+            echo "$out" | sed "s/}\$/, $(awk -v t=$((after - before)) \
+                -v hz="$hz" -v r="${requests:-0}" -v b="${body:-0}" \
+                'BEGIN { printf("\"server_cpu_sec\": %.2f, \"cpu_us_per_req\": %.1f, \"body_bytes_per_req\": %.0f",
+                    t / hz, r ? t / hz * 1e6 / r : 0, r ? b / r : 0) }')}/" \
+                | tee -a "${BENCH_OUT:-/dev/null}"
+        done
+        stop_server
+        sleep 0.5
+    done
+    exit 0
+fi
+
+start_server
+
+for file in small.bin large.bin; do
+    for mode in close keepalive; do
+        for c in $CONCURRENCY; do
+            flags=
+            [ "$mode" = keepalive ] && flags=-k
+            "$BINDIR/loadgen" -p "$PORT" -u "/$file" -c "$c" \
+                -d "$DURATION" $flags -l "$file-$mode-c$c" \
+                | tee -a "${BENCH_OUT:-/dev/null}"
+        done
+    done
+done
@@ -1,6 +1,12 @@
 #ifndef CONF_H
 #define CONF_H
 
+#include <stddef.h>
+
+enum cpu_affinity { AFFINITY_OFF, AFFINITY_CORE, AFFINITY_NODE };
+enum io_engine { ENGINE_EPOLL, ENGINE_URING };
+enum dispatch { DISPATCH_ROUND_ROBIN, DISPATCH_LEAST_LOADED };
+
 struct conf
 {
     char* document_root;
@@ -11,7 +17,59 @@ struct conf
     char* user;
     char* group;
     char* config_file;
+    char* reuseport;
+    char* workers;
+    char* cpu_affinity;
+    char* cache_size;
+    char* cache_valid;
+    char* gzip;
+    char* gzip_min_size;
+    char* gzip_level;
+    char* header_timeout;
+    char* idle_timeout;
+    char* send_timeout;
+    char* io_engine;
+    char* status_uri;
+    char* access_log;
+    char* log_format;
+    char* log_overflow;
+    char* debug_log;
+    char* dispatch;
+    char* drain_timeout;
+    char* mime_types;
+    char* watch;
+    char* pack;
+    char* backlog;
+    char* defer_accept;
+    char* fastopen;
     char** opts;
+
+    /* values derived from the options above */
+    int reuse_port;
+    int nworkers;
+    enum cpu_affinity affinity;
+    size_t cache_max_mem;
+    int cache_valid_sec;
+    int gzip_on;
+    size_t gzip_min;
+    int gzip_comp_level;
+    int header_timeout_sec;
+    int idle_timeout_sec;
+    int send_timeout_sec;
+    enum io_engine engine;
+    int status_on;
+    int access_log_on;
+    int log_combined;   // the combined format rather than the common one
+    int log_block;      // wait for the flusher rather than drop records
+    int debug_on;
+    enum dispatch dispatch_mode;
+    int drain_timeout_sec;
+    int mime_types_on;
+    int watch_on;
+    int pack_on;
+    int listen_backlog;
+    int defer_accept_sec;
+    int fastopen_qlen;
 };
 
 #endif
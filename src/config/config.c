@@ -4,9 +4,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 struct conf g_conf;
 #define WEB_SERVER_VERSION "1.0"
@@ -17,6 +20,35 @@ struct conf g_conf;
 #define DEF_HOST NULL
 #define DEF_USER_NAME "root"
 #define DEF_GROUP_NAME "root"
+#define DEF_REUSEPORT "off"
+#define DEF_WORKERS "auto"
+#define DEF_CPU_AFFINITY "off"
+#define MAX_WORKERS 1024
+#define DEF_CACHE_SIZE "16m"
+#define DEF_CACHE_VALID "5"
+#define DEF_GZIP "off"
+#define DEF_GZIP_MIN_SIZE "1k"
+#define DEF_GZIP_LEVEL "6"
+#define MAX_TIMEOUT 86400 // fits into the timer wheel
+#define DEF_HEADER_TIMEOUT "10"
+#define DEF_IDLE_TIMEOUT "15"
+#define DEF_SEND_TIMEOUT "30"
+#define DEF_IO_ENGINE "epoll"
+#define DEF_STATUS_URI "off"
+#define DEF_ACCESS_LOG "off"
+#define DEF_LOG_FORMAT "combined"
+#define DEF_LOG_OVERFLOW "drop"
+#define DEF_DEBUG_LOG "on"
+#define DEF_DISPATCH "least-loaded"
+#define DEF_DRAIN_TIMEOUT "30"
+#define DEF_MIME_TYPES "/etc/mime.types"
+#define DEF_WATCH "on"
+#define DEF_PACK "off"
+#define DEF_BACKLOG "auto"
+#define DEF_DEFER_ACCEPT "0"
+#define DEF_FASTOPEN "0"
+/** The limit of listen() backlogs of the system */
+#define SOMAXCONN_PATH "/proc/sys/net/core/somaxconn"
 
 #define OPTSTRING "vhlr:i:u:g:"
 static const struct option g_lopts[] = {
@@ -27,12 +59,42 @@ static const struct option g_lopts[] = {
     {"host", required_argument, NULL, 3},
     {"user", required_argument, NULL, 'u'},
     {"group", required_argument, NULL, 'g'}, 
+    {"reuseport", required_argument, NULL, 4},
+    {"workers", required_argument, NULL, 5},
+    {"cpu-affinity", required_argument, NULL, 6},
+    {"cache-size", required_argument, NULL, 7},
+    {"cache-valid", required_argument, NULL, 8},
+    {"gzip", required_argument, NULL, 9},
+    {"gzip-min-size", required_argument, NULL, 10},
+    {"gzip-level", required_argument, NULL, 11},
+    {"header-timeout", required_argument, NULL, 12},
+    {"idle-timeout", required_argument, NULL, 13},
+    {"send-timeout", required_argument, NULL, 14},
+    {"io-engine", required_argument, NULL, 15},
+    {"status-uri", required_argument, NULL, 16},
+    {"access-log", required_argument, NULL, 17},
+    {"log-format", required_argument, NULL, 18},
+    {"log-overflow", required_argument, NULL, 19},
+    {"debug-log", required_argument, NULL, 20},
+    {"dispatch", required_argument, NULL, 21},
+    {"drain-timeout", required_argument, NULL, 22},
+    {"mime-types", required_argument, NULL, 23},
+    {"watch", required_argument, NULL, 24},
+    {"pack", required_argument, NULL, 25},
+    {"backlog", required_argument, NULL, 26},
+    {"defer-accept", required_argument, NULL, 27},
+    {"fastopen", required_argument, NULL, 28},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'v'},
     {NULL     , 0          , NULL, 0}
 };
 static const char * const g_params
-    = "document-root index-page log port host user group";
+    = "document-root index-page log port host user group reuseport "
+      "workers cpu-affinity cache-size cache-valid gzip gzip-min-size "
+      "gzip-level header-timeout idle-timeout send-timeout io-engine "
+      "status-uri access-log log-format log-overflow debug-log "
+      "dispatch drain-timeout mime-types watch pack backlog defer-accept "
+      "fastopen";
 
 static void
 printhelp()
@@ -52,6 +114,67 @@ printhelp()
 "--host host                 : Listen for the given IP adress\n"
 "-u, --user user             : Change the user id of the process\n"
 "-g, --group group           : Change the group id of the process\n"
+"--reuseport on|off          : Let every worker accept connections on its own\n"
+"                              SO_REUSEPORT socket (default: off)\n"
+"--backlog n|auto            : Connections the kernel queues until they are\n"
+"                              accepted (default: auto, i.e. the limit of\n"
+"                              net.core.somaxconn)\n"
+"--defer-accept seconds      : Let the kernel hold back a connection until\n"
+"                              its request arrives, for at most so long\n"
+"                              (default: 0, i.e. off)\n"
+"--fastopen n                : Accept requests sent along with the SYN of\n"
+"                              TCP Fast Open clients, at most n at a time\n"
+"                              (default: 0, i.e. off)\n"
+"--workers n|auto            : Number of worker processes (default: auto,\n"
+"                              i.e. the number of online CPUs)\n"
+"--cpu-affinity off|core|node: Pin every worker to a CPU core or to the CPUs\n"
+"                              of a NUMA node (default: off)\n"
+"--cache-size size           : Memory limit of the file cache of each worker,\n"
+"                              k, m and g suffixes are allowed; 0 disables\n"
+"                              the cache (default: 16m)\n"
+"--cache-valid seconds       : How long a cached file is served without\n"
+"                              checking it on disk (default: 5)\n"
+"--gzip on|off               : Compress text files which have no precompressed\n"
+"                              .gz sidecar on the fly (default: off)\n"
+"--gzip-min-size size        : Smaller files are sent as is (default: 1k)\n"
+"--gzip-level 1-9            : zlib compression level (default: 6)\n"
+"--header-timeout seconds    : Close a connection which does not send a whole\n"
+"                              request header in time (default: 10)\n"
+"--idle-timeout seconds      : Close a keep-alive connection which waits for\n"
+"                              the next request for so long (default: 15)\n"
+"--send-timeout seconds      : Close a connection which does not accept any\n"
+"                              response data for so long (default: 30);\n"
+"                              0 disables any of these timeouts\n"
+"--io-engine epoll|uring     : How workers wait for and perform socket I/O:\n"
+"                              readiness with epoll or batched submissions\n"
+"                              with io_uring (default: epoll)\n"
+"--status-uri uri|off        : Answer requests for the URI with live counters\n"
+"                              of the workers, as JSON if \"?json\" is\n"
+"                              appended (default: off)\n"
+"--access-log path|off       : Write an access log (default: off)\n"
+"--log-format common|combined: The format of access log records\n"
+"                              (default: combined)\n"
+"--log-overflow drop|block   : What a worker does with a record when the log\n"
+"                              writer falls behind (default: drop)\n"
+"--debug-log on|off          : Log every connection and request path to the\n"
+"                              server log (default: on)\n"
+"--dispatch round-robin|least-loaded: How the server process hands out\n"
+"                              connections without --reuseport: in turn, or\n"
+"                              to the worker with the fewest active and\n"
+"                              backlogged ones (default: least-loaded)\n"
+"--drain-timeout seconds     : How long the workers of the old configuration\n"
+"                              finish their connections after a reload\n"
+"                              (default: 30)\n"
+"--mime-types path|off       : A mime.types file which maps file extensions\n"
+"                              to Content-type, off keeps only a few built-in\n"
+"                              types (default: /etc/mime.types)\n"
+"--watch on|off              : Watch the document root with inotify and drop\n"
+"                              changed files from the caches at once; off\n"
+"                              checks cached files with stat() after\n"
+"                              --cache-valid seconds (default: on)\n"
+"--pack path|off             : Serve the files of a pack built by sitepack\n"
+"                              before the document root, from memory\n"
+"                              (default: off)\n"
 "-h, --help                  : Print help (this message) and exit\n"
 "-v, --version               : Print version information and exit\n",
             WEB_SERVER_VERSION
@@ -82,6 +205,133 @@ allocopts()
     }
 }
 
+static int
+parse_switch(const char* param, const char* arg)
+{
+    if(0 == strcmp(arg, "on") || 0 == strcmp(arg, "yes"))
+        return 1;
+    if(0 == strcmp(arg, "off") || 0 == strcmp(arg, "no"))
+        return 0;
+
+    fprintf(stderr, "[config] \"%s\" expects on or off, got \"%s\"\n",
+            param, arg);
+    return -1;
+}
+
+static long
+parse_number(const char* param, const char* arg, long min, long max)
+{
+    char* end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if(0 != errno || end == arg || '\0' != *end || n < min || n > max)
+    {
+        fprintf(stderr, "[config] \"%s\" expects a number in [%ld, %ld], "
+                "got \"%s\"\n", param, min, max, arg);
+        return -1;
+    }
+    return n;
+}
+
+static long
+parse_size(const char* param, const char* arg)
+{
+    char* end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(arg, &end, 10);
+    switch(*end)
+    {
+        case 'g': case 'G': n *= 1024; // fall through
+        case 'm': case 'M': n *= 1024; // fall through
+        case 'k': case 'K': n *= 1024; ++end; break;
+    }
+    if(0 != errno || end == arg || '\0' != *end || n < 0 || n > LONG_MAX)
+    {
+        fprintf(stderr, "[config] \"%s\" expects a size, got \"%s\"\n",
+                param, arg);
+        return -1;
+    }
+    return n;
+}
+
+static int
+parse_workers(const char* arg)
+{
+    long n;
+
+    if(0 == strcmp(arg, "auto"))
+    {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        return (0 < n && n <= MAX_WORKERS) ? n : 1;
+    }
+    return parse_number("workers", arg, 1, MAX_WORKERS);
+}
+
+/** "auto" takes the limit the kernel would cut a larger backlog down to */
+static int
+parse_backlog(const char* arg)
+{
+    FILE* f;
+    int n = SOMAXCONN;
+
+    if(0 != strcmp(arg, "auto"))
+        return parse_number("backlog", arg, 1, INT_MAX);
+    if(NULL != (f = fopen(SOMAXCONN_PATH, "r")))
+    {
+        if(1 != fscanf(f, "%d", &n) || 0 >= n)
+            n = SOMAXCONN;
+        fclose(f);
+    }
+    return n;
+}
+
+static int
+parse_affinity(const char* arg)
+{
+    if(0 == strcmp(arg, "off"))
+        return AFFINITY_OFF;
+    if(0 == strcmp(arg, "core"))
+        return AFFINITY_CORE;
+    if(0 == strcmp(arg, "node"))
+        return AFFINITY_NODE;
+
+    fprintf(stderr, "[config] \"cpu-affinity\" expects off, core or node, "
+            "got \"%s\"\n", arg);
+    return -1;
+}
+
+static int
+parse_engine(const char* arg)
+{
+    if(0 == strcmp(arg, "epoll"))
+        return ENGINE_EPOLL;
+    if(0 == strcmp(arg, "uring"))
+        return ENGINE_URING;
+
+    fprintf(stderr, "[config] \"io-engine\" expects epoll or uring, "
+            "got \"%s\"\n", arg);
+    return -1;
+}
+
+/** Returns 0 for the first of two allowed values, 1 for the second one */
+static int
+parse_choice(const char* param, const char* arg, const char* first,
+             const char* second)
+{
+    if(0 == strcmp(arg, first))
+        return 0;
+    if(0 == strcmp(arg, second))
+        return 1;
+
+    fprintf(stderr, "[config] \"%s\" expects %s or %s, got \"%s\"\n",
+            param, first, second, arg);
+    return -1;
+}
+
 static int
 isstrblank(const char* s)
 {
@@ -158,7 +408,7 @@ loadconfig()
                 break;
             }
         }
-        if(0 != (error = ferror(cfile)))
+        if(0 == error && 0 != (error = ferror(cfile)))
         {
             perror("[config] An error occurred while loading a config");
         }
@@ -177,11 +427,9 @@ loadconfig()
 int
 recfgmngr()
 {
-    if(NULL != g_conf.opts)
-    {
-        free(g_conf.opts);
-        g_conf.opts = NULL;
-    }
+    // the running configuration stays intact until the new one is valid
+    struct conf old = g_conf;
+
     if(NULL == g_conf.config_file)
     {
         fprintf(stderr,
@@ -189,17 +437,24 @@ recfgmngr()
                 "but no path was specified on server\'s startup\n");
         return -1;
     }
-    char* p = g_conf.config_file;
     memset(&g_conf, 0, sizeof(g_conf));
-    g_conf.config_file = p;
+    g_conf.config_file = old.config_file;
 
-    return loadconfig();
+    if(0 != loadconfig())
+    {
+        free(g_conf.opts);
+        g_conf = old;
+        return -1;
+    }
+    free(old.opts);
+    return 0;
 }
 
 int
 cfgmngr(int argc, char** argv)
 {
     int opt;
+    long size;
     char reload = 0;
 
     while(-1 != (opt = getopt_long(argc, argv, OPTSTRING, g_lopts, NULL)))
@@ -218,6 +473,106 @@ cfgmngr(int argc, char** argv)
                 if(NULL == g_conf.host)
                     g_conf.host = optarg;
                 break;
+            case 4:
+                if(NULL == g_conf.reuseport)
+                    g_conf.reuseport = optarg;
+                break;
+            case 5:
+                if(NULL == g_conf.workers)
+                    g_conf.workers = optarg;
+                break;
+            case 6:
+                if(NULL == g_conf.cpu_affinity)
+                    g_conf.cpu_affinity = optarg;
+                break;
+            case 7:
+                if(NULL == g_conf.cache_size)
+                    g_conf.cache_size = optarg;
+                break;
+            case 8:
+                if(NULL == g_conf.cache_valid)
+                    g_conf.cache_valid = optarg;
+                break;
+            case 9:
+                if(NULL == g_conf.gzip)
+                    g_conf.gzip = optarg;
+                break;
+            case 10:
+                if(NULL == g_conf.gzip_min_size)
+                    g_conf.gzip_min_size = optarg;
+                break;
+            case 11:
+                if(NULL == g_conf.gzip_level)
+                    g_conf.gzip_level = optarg;
+                break;
+            case 12:
+                if(NULL == g_conf.header_timeout)
+                    g_conf.header_timeout = optarg;
+                break;
+            case 13:
+                if(NULL == g_conf.idle_timeout)
+                    g_conf.idle_timeout = optarg;
+                break;
+            case 14:
+                if(NULL == g_conf.send_timeout)
+                    g_conf.send_timeout = optarg;
+                break;
+            case 15:
+                if(NULL == g_conf.io_engine)
+                    g_conf.io_engine = optarg;
+                break;
+            case 16:
+                if(NULL == g_conf.status_uri)
+                    g_conf.status_uri = optarg;
+                break;
+            case 17:
+                if(NULL == g_conf.access_log)
+                    g_conf.access_log = optarg;
+                break;
+            case 18:
+                if(NULL == g_conf.log_format)
+                    g_conf.log_format = optarg;
+                break;
+            case 19:
+                if(NULL == g_conf.log_overflow)
+                    g_conf.log_overflow = optarg;
+                break;
+            case 20:
+                if(NULL == g_conf.debug_log)
+                    g_conf.debug_log = optarg;
+                break;
+            case 21:
+                if(NULL == g_conf.dispatch)
+                    g_conf.dispatch = optarg;
+                break;
+            case 22:
+                if(NULL == g_conf.drain_timeout)
+                    g_conf.drain_timeout = optarg;
+                break;
+            case 23:
+                if(NULL == g_conf.mime_types)
+                    g_conf.mime_types = optarg;
+                break;
+            case 24:
+                if(NULL == g_conf.watch)
+                    g_conf.watch = optarg;
+                break;
+            case 25:
+                if(NULL == g_conf.pack)
+                    g_conf.pack = optarg;
+                break;
+            case 26:
+                if(NULL == g_conf.backlog)
+                    g_conf.backlog = optarg;
+                break;
+            case 27:
+                if(NULL == g_conf.defer_accept)
+                    g_conf.defer_accept = optarg;
+                break;
+            case 28:
+                if(NULL == g_conf.fastopen)
+                    g_conf.fastopen = optarg;
+                break;
             case 'l':
                 if(NULL == g_conf.log_path)
                     g_conf.log_path = DEF_NO_LOG;
@@ -273,6 +628,136 @@ cfgmngr(int argc, char** argv)
             g_conf.port = DEF_PORT;
         if(NULL == g_conf.host)
             g_conf.host = DEF_HOST;
+        if(NULL == g_conf.reuseport)
+            g_conf.reuseport = DEF_REUSEPORT;
+        if(NULL == g_conf.workers)
+            g_conf.workers = DEF_WORKERS;
+        if(NULL == g_conf.cpu_affinity)
+            g_conf.cpu_affinity = DEF_CPU_AFFINITY;
+        if(NULL == g_conf.cache_size)
+            g_conf.cache_size = DEF_CACHE_SIZE;
+        if(NULL == g_conf.cache_valid)
+            g_conf.cache_valid = DEF_CACHE_VALID;
+        if(NULL == g_conf.gzip)
+            g_conf.gzip = DEF_GZIP;
+        if(NULL == g_conf.gzip_min_size)
+            g_conf.gzip_min_size = DEF_GZIP_MIN_SIZE;
+        if(NULL == g_conf.gzip_level)
+            g_conf.gzip_level = DEF_GZIP_LEVEL;
+        if(NULL == g_conf.header_timeout)
+            g_conf.header_timeout = DEF_HEADER_TIMEOUT;
+        if(NULL == g_conf.idle_timeout)
+            g_conf.idle_timeout = DEF_IDLE_TIMEOUT;
+        if(NULL == g_conf.send_timeout)
+            g_conf.send_timeout = DEF_SEND_TIMEOUT;
+        if(NULL == g_conf.io_engine)
+            g_conf.io_engine = DEF_IO_ENGINE;
+        if(NULL == g_conf.status_uri)
+            g_conf.status_uri = DEF_STATUS_URI;
+        if(NULL == g_conf.access_log)
+            g_conf.access_log = DEF_ACCESS_LOG;
+        if(NULL == g_conf.log_format)
+            g_conf.log_format = DEF_LOG_FORMAT;
+        if(NULL == g_conf.log_overflow)
+            g_conf.log_overflow = DEF_LOG_OVERFLOW;
+        if(NULL == g_conf.debug_log)
+            g_conf.debug_log = DEF_DEBUG_LOG;
+        if(NULL == g_conf.dispatch)
+            g_conf.dispatch = DEF_DISPATCH;
+        if(NULL == g_conf.drain_timeout)
+            g_conf.drain_timeout = DEF_DRAIN_TIMEOUT;
+        if(NULL == g_conf.mime_types)
+            g_conf.mime_types = DEF_MIME_TYPES;
+        if(NULL == g_conf.watch)
+            g_conf.watch = DEF_WATCH;
+        if(NULL == g_conf.pack)
+            g_conf.pack = DEF_PACK;
+        if(NULL == g_conf.backlog)
+            g_conf.backlog = DEF_BACKLOG;
+        if(NULL == g_conf.defer_accept)
+            g_conf.defer_accept = DEF_DEFER_ACCEPT;
+        if(NULL == g_conf.fastopen)
+            g_conf.fastopen = DEF_FASTOPEN;
+
+        if(-1 == (g_conf.reuse_port
+                    = parse_switch("reuseport", g_conf.reuseport)))
+            return -1;
+        if(-1 == (g_conf.nworkers = parse_workers(g_conf.workers)))
+            return -1;
+        if(-1 == (g_conf.listen_backlog = parse_backlog(g_conf.backlog)))
+            return -1;
+        if(-1 == (g_conf.defer_accept_sec
+                    = parse_number("defer-accept", g_conf.defer_accept,
+                        0, MAX_TIMEOUT)))
+            return -1;
+        if(-1 == (g_conf.fastopen_qlen
+                    = parse_number("fastopen", g_conf.fastopen, 0, INT_MAX)))
+            return -1;
+        if(-1 == (opt = parse_affinity(g_conf.cpu_affinity)))
+            return -1;
+        g_conf.affinity = opt;
+        if(-1 == (size = parse_size("cache-size", g_conf.cache_size)))
+            return -1;
+        g_conf.cache_max_mem = size;
+        if(-1 == (g_conf.cache_valid_sec
+                    = parse_number("cache-valid", g_conf.cache_valid,
+                        0, INT_MAX)))
+            return -1;
+        if(-1 == (g_conf.gzip_on = parse_switch("gzip", g_conf.gzip)))
+            return -1;
+        if(-1 == (size = parse_size("gzip-min-size", g_conf.gzip_min_size)))
+            return -1;
+        g_conf.gzip_min = size;
+        if(-1 == (g_conf.gzip_comp_level
+                    = parse_number("gzip-level", g_conf.gzip_level, 1, 9)))
+            return -1;
+        if(-1 == (g_conf.header_timeout_sec
+                    = parse_number("header-timeout", g_conf.header_timeout,
+                        0, MAX_TIMEOUT)))
+            return -1;
+        if(-1 == (g_conf.idle_timeout_sec
+                    = parse_number("idle-timeout", g_conf.idle_timeout,
+                        0, MAX_TIMEOUT)))
+            return -1;
+        if(-1 == (g_conf.send_timeout_sec
+                    = parse_number("send-timeout", g_conf.send_timeout,
+                        0, MAX_TIMEOUT)))
+            return -1;
+        if(-1 == (opt = parse_engine(g_conf.io_engine)))
+            return -1;
+        g_conf.engine = opt;
+        if(0 != strcmp(g_conf.status_uri, "off"))
+        {
+            if('/' != g_conf.status_uri[0])
+            {
+                fprintf(stderr, "[config] \"status-uri\" has to start "
+                        "with /, got \"%s\"\n", g_conf.status_uri);
+                return -1;
+            }
+            g_conf.status_on = 1;
+        }
+        g_conf.access_log_on = (0 != strcmp(g_conf.access_log, "off"));
+        if(-1 == (g_conf.log_combined = parse_choice("log-format",
+                        g_conf.log_format, "common", "combined")))
+            return -1;
+        if(-1 == (g_conf.log_block = parse_choice("log-overflow",
+                        g_conf.log_overflow, "drop", "block")))
+            return -1;
+        if(-1 == (g_conf.debug_on
+                    = parse_switch("debug-log", g_conf.debug_log)))
+            return -1;
+        if(-1 == (opt = parse_choice("dispatch", g_conf.dispatch,
+                        "round-robin", "least-loaded")))
+            return -1;
+        g_conf.dispatch_mode = opt;
+        if(-1 == (g_conf.drain_timeout_sec
+                    = parse_number("drain-timeout", g_conf.drain_timeout,
+                        0, MAX_TIMEOUT)))
+            return -1;
+        g_conf.mime_types_on = (0 != strcmp(g_conf.mime_types, "off"));
+        if(-1 == (g_conf.watch_on = parse_switch("watch", g_conf.watch)))
+            return -1;
+        g_conf.pack_on = (0 != strcmp(g_conf.pack, "off"));
 
         if(NULL == g_conf.user || NULL == g_conf.group)
         {
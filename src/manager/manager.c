@@ -1,9 +1,9 @@
 #include "config/config.h"
 #include "server/server.h"
+#include "server/stats.h"
 
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,15 +19,20 @@ extern struct conf g_conf;
 static int g_isRunning;
 static int g_doReconfiguration;
 
-static volatile sig_atomic_t g_nsig;
+/** Signals caught since they were looked at last, a bit per signal */
+static volatile sig_atomic_t g_signals;
 
-/** Adress of the semaphore */
-static sem_t* g_sem;
+#define SIGBIT(nsig) (1 << (nsig))
+
+/** The server process which serves and the one which is being started by
+ *  a reload; the ones which have been replaced drain on their own */
+static pid_t g_servpid = -1;
+static pid_t g_nextpid = -1;
 
 static void
 sig_handler(int nsig)
 {
-    g_nsig = nsig;
+    g_signals |= SIGBIT(nsig);
 }
 
 static int
@@ -38,31 +43,18 @@ setupsig()
 
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = sig_handler;
-    sigemptyset(&sa.sa_mask);
+    // the handlers do not interrupt each other updating g_signals
+    sigfillset(&sa.sa_mask);
 
     rv |= sigaction(SIGINT, &sa, NULL);
     rv |= sigaction(SIGTERM, &sa, NULL);
     rv |= sigaction(SIGCHLD, &sa, NULL);
     rv |= sigaction(SIGHUP, &sa, NULL);
+    rv |= sigaction(SIGUSR1, &sa, NULL);
 
     return rv;
 }
 
-static int
-setupsem()
-{
-    if(SEM_FAILED != (g_sem = 
-                sem_open("/webserver.sem", O_CREAT | O_RDWR, 0666, 0)))
-    {
-        return 0;
-    }
-    else
-    {
-        perror("[manager] sem_open");
-        return -1;
-    }
-}
-
 static void
 setupipc()
 {
@@ -71,11 +63,6 @@ setupipc()
         fprintf(stderr, "[manager] Could not init signals\n");
         exit(EXIT_FAILURE);
     }
-    if(0 != setupsem())
-    {
-        fprintf(stderr, "[manager] Could not init a semaphore\n");
-        exit(EXIT_FAILURE);
-    }
 }
 
 static void
@@ -87,6 +74,7 @@ blockhandledsignals()
     sigaddset(&mask, SIGTERM);
     sigaddset(&mask, SIGHUP);
     sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
     sigprocmask(SIG_BLOCK, &mask, NULL);
 }
 /*
@@ -123,6 +111,7 @@ blockforsuspend(int how, sigset_t* set)
         sigdelset(&mask, SIGINT);
         sigdelset(&mask, SIGCHLD);
         sigdelset(&mask, SIGTERM);
+        sigdelset(&mask, SIGUSR1);
         ++once;
     }
 
@@ -139,87 +128,103 @@ blockforsuspend(int how, sigset_t* set)
     }
 }
 
+/** Sleeps until a handled signal comes and returns the caught ones */
 static int
-waitserver(pid_t servpid)
+waitsignals()
 {
-    int status;
+    int caught;
     sigset_t mask;
 
     blockforsuspend(SIG_BLOCK, &mask);
-    g_nsig = 0;
-    while(0 == g_nsig)
+    while(0 == g_signals)
     {
         sigsuspend(&mask);
-        // all signals are blocked again at this point
-
-        int rv;
-        int val;
-        switch(g_nsig)
-        {
-            case SIGCHLD:
-                if(-1 != (rv = sem_getvalue(g_sem, &val)))
-                {
-                    if(0 != val)
-                    {
-                        g_isRunning = 1;
-                        g_doReconfiguration = 1;
-                        sem_wait(g_sem); // --*sem
-                    }
-                    else
-                    {
-                        g_isRunning = 0;
-                    }
-                }
-                else
-                {
-                    fprintf(stderr, 
-                            "[manager] sem_getvalue returned %d\n", rv);
-                }
-                break;
-            case SIGHUP:
-                g_isRunning = 1;
-                g_doReconfiguration = 1;
-                kill(servpid, SIGTERM);
-                break;
-            case SIGTERM:
-            case SIGINT:
-                g_isRunning = 0;
-                kill(servpid, SIGTERM);
-                break;
-            default:
-                continue;
-        }
     }
+    // all signals are blocked again at this point
+    caught = g_signals;
+    g_signals = 0;
     blockforsuspend(SIG_UNBLOCK, NULL);
+    return caught;
+}
+
+static void
+reapservers()
+{
+    pid_t pid;
 
-    waitpid(servpid, &status, 0); 
-    if(WIFEXITED(status))
+    while(0 < (pid = waitpid(-1, NULL, WNOHANG)))
     {
-        return WEXITSTATUS(status);
+        if(pid == g_servpid)
+        {
+            g_servpid = -1;
+            g_isRunning = 0;
+        }
+        else if(pid == g_nextpid)
+        {
+            fprintf(stderr, "[manager] The server with the new "
+                    "configuration has failed to start\n");
+            g_nextpid = -1;
+        }
+        else
+        {
+            printf("[manager] %d has drained\n", (int) pid);
+        }
     }
-    return -1;
 }
 
+/** Starts a new generation of the server; the current one keeps serving
+ *  until the new one is up */
 static void
-create_webserver()
+reload()
 {
-    pid_t servpid = runservinproc();
+    pid_t pid;
 
-    if(-1 != servpid)
+    if(-1 != g_nextpid)
     {
-        printf("[manager] %d %d\n", (int) getpid(), servpid);
-        waitserver(servpid);
+        g_doReconfiguration = 1; // once the pending one is up
+        return;
     }
-    else
+    g_doReconfiguration = 0;
+
+    if(0 != recfgmngr())
+    {
+        fprintf(stderr, "[manager] Reconfiguration failed, "
+                "the server keeps the old configuration\n");
+        return;
+    }
+    if(-1 == open_listeners())
+    {
+        fprintf(stderr, "[manager] Could not listen with the new "
+                "configuration, the server keeps the old one\n");
+        return;
+    }
+    if(-1 == (pid = runservinproc()))
     {
         perror("[manager] fork failed");
+        return;
     }
+    printf("[manager] %d %d\n", (int) getpid(), pid);
+    g_nextpid = pid;
+}
+
+/** The new generation is up, the old one stops accepting and finishes
+ *  its connections */
+static void
+takeover()
+{
+    if(-1 == g_nextpid)
+        return;
+    kill(g_servpid, SIGQUIT);
+    g_servpid = g_nextpid;
+    g_nextpid = -1;
 }
 
 int
 manage(int argc, char** argv)
 {
-    g_nsig = 0;
+    int caught;
+
+    g_signals = 0;
     g_isRunning = 1;
     g_doReconfiguration = 0;
 
@@ -234,28 +239,38 @@ manage(int argc, char** argv)
     blockhandledsignals();
     setupipc();
 
-    while(1)
+    if(-1 == open_listeners())
     {
-        if(1 == g_isRunning)
-        {
-            if(1 == g_doReconfiguration)
-            {
-                if(0 != recfgmngr())
-                {
-                    fprintf(stderr, "[manager] Reconfiguration failed\n");
-                    return -1;
-                }
-                g_doReconfiguration = 0;
-            }
-            create_webserver(); 
-        }
-        else
-        {
-            fprintf(stderr, "[manager] isRunning == false\n");
-            sem_close(g_sem);
+        fprintf(stderr, "[manager] Initialization of the server failed\n");
+        return -1;
+    }
+    if(-1 == (g_servpid = runservinproc()))
+    {
+        perror("[manager] fork failed");
+        return -1;
+    }
+    printf("[manager] %d %d\n", (int) getpid(), g_servpid);
+
+    while(1 == g_isRunning)
+    {
+        caught = waitsignals();
+        if(caught & SIGBIT(SIGCHLD))
+            reapservers();
+        if(caught & (SIGBIT(SIGTERM) | SIGBIT(SIGINT)))
+            g_isRunning = 0;
+        if(1 != g_isRunning)
             break;
-        }
+        if(caught & SIGBIT(SIGUSR1))
+            takeover();
+        if((caught & SIGBIT(SIGHUP)) || 1 == g_doReconfiguration)
+            reload();
     }
 
+    fprintf(stderr, "[manager] isRunning == false\n");
+    // every generation, including the draining ones, is in our group
+    kill(0, SIGTERM);
+    while(-1 != wait(NULL) || EINTR == errno)
+        ;
+    stats_destroy();
     return 0;
 }
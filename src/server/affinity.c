@@ -0,0 +1,147 @@
+#include "server/affinity.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+static int
+parse_cpulist(const char* list, cpu_set_t* set)
+{
+    char* end;
+    long from;
+    long to;
+
+    CPU_ZERO(set);
+    while('\0' != *list && '\n' != *list)
+    {
+        from = to = strtol(list, &end, 10);
+        if(end == list)
+            return -1;
+        if('-' == *end)
+        {
+            list = end + 1;
+            to = strtol(list, &end, 10);
+            if(end == list)
+                return -1;
+        }
+        for(; from <= to && from < CPU_SETSIZE; ++from)
+            CPU_SET(from, set);
+        list = (',' == *end) ? end + 1 : end;
+    }
+    return 0;
+}
+
+static int
+read_node_cpus(const char* node, cpu_set_t* set)
+{
+    char path[300];
+    char list[1024];
+    FILE* f;
+    int rv = -1;
+
+    snprintf(path, sizeof(path), NODE_DIR "/%s/cpulist", node);
+    if(NULL != (f = fopen(path, "r")))
+    {
+        if(NULL != fgets(list, sizeof(list), f))
+            rv = parse_cpulist(list, set);
+        fclose(f);
+    }
+    return rv;
+}
+
+/** Collects the CPU sets of NUMA nodes restricted to the allowed CPUs */
+static int
+get_nodes(const cpu_set_t* allowed, cpu_set_t* nodes, int maxnodes)
+{
+    DIR* dir;
+    struct dirent* de;
+    int n = 0;
+
+    if(NULL == (dir = opendir(NODE_DIR)))
+    {
+        perror("[affinity] opendir(" NODE_DIR ")");
+        return 0;
+    }
+    while(n < maxnodes && NULL != (de = readdir(dir)))
+    {
+        if(0 != strncmp(de->d_name, "node", 4)
+                || '0' > de->d_name[4] || '9' < de->d_name[4])
+            continue;
+        if(0 == read_node_cpus(de->d_name, &nodes[n]))
+        {
+            CPU_AND(&nodes[n], &nodes[n], allowed);
+            if(0 < CPU_COUNT(&nodes[n]))
+                ++n;
+        }
+    }
+    closedir(dir);
+    return n;
+}
+
+int
+plan_cpu_affinity(cpu_set_t* sets, int nworkers, enum cpu_affinity how)
+{
+    int i;
+    int n = 0;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t allowed;
+    cpu_set_t* nodes;
+
+    if(-1 == sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        perror("[affinity] sched_getaffinity()");
+        return -1;
+    }
+    for(i = 0; i < nworkers; ++i)
+        sets[i] = allowed;
+
+    switch(how)
+    {
+        case AFFINITY_CORE:
+            for(i = 0; i < CPU_SETSIZE; ++i)
+            {
+                if(CPU_ISSET(i, &allowed))
+                    cpus[n++] = i;
+            }
+            for(i = 0; i < nworkers && 0 < n; ++i)
+            {
+                CPU_ZERO(&sets[i]);
+                CPU_SET(cpus[i % n], &sets[i]);
+            }
+            break;
+        case AFFINITY_NODE:
+            if(NULL == (nodes = malloc(CPU_SETSIZE * sizeof(*nodes))))
+            {
+                perror("[affinity] malloc");
+                return -1;
+            }
+            if(0 == (n = get_nodes(&allowed, nodes, CPU_SETSIZE)))
+            {
+                fprintf(stderr, "[affinity] NUMA topology is unknown, "
+                        "workers are not pinned\n");
+            }
+            for(i = 0; i < nworkers && 0 < n; ++i)
+            {
+                sets[i] = nodes[i % n];
+            }
+            free(nodes);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+int
+pin_to_cpus(const cpu_set_t* set)
+{
+    if(-1 == sched_setaffinity(0, sizeof(*set), set))
+    {
+        perror("[affinity] sched_setaffinity()");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config/conf.h"
+
+#include <sched.h>
+
+// fills sets[i] with the CPUs the i-th worker should run on; the NUMA
+// topology is read from sysfs, so it has to be called before chroot
+int
+plan_cpu_affinity(cpu_set_t* sets, int nworkers, enum cpu_affinity how);
+
+int
+pin_to_cpus(const cpu_set_t* set);
+
+#endif
@@ -0,0 +1,493 @@
+#include "server/cache.h"
+#include "server/handler.h"
+#include "server/stats.h"
+#include "server/watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_MIN_BUCKETS 1024
+/** Failed lookups may take this part of the limit on top of it */
+#define CACHE_MISSES_SHARE 16
+
+struct lru
+{
+    struct cache_entry* head; // the most recently used
+    struct cache_entry* tail;
+    size_t mem;
+};
+
+static struct cache
+{
+    struct cache_entry** buckets;
+    size_t nbuckets;    // a power of two
+    size_t count;
+    size_t max_mem;
+    int valid;
+    struct lru files;
+    struct lru misses;  // apart, so a scan for missing paths keeps the files
+} g_cache;
+
+#define LRU_OF(e) ((OK == (e)->status) ? &g_cache.files : &g_cache.misses)
+
+/** Entries are keyed by the path and the encoding; the watcher only
+ *  knows the path */
+#define HASH_KEY(h, encoding) ((h) ^ (unsigned int) (encoding))
+
+/** The changes published by the watcher which the worker has applied */
+static unsigned long g_watch_seq;
+static unsigned long g_watch_flush;
+
+unsigned int
+cache_hash_path(const char* s)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+
+    while('\0' != *s)
+    {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int
+hash_uri(const char* s, enum content_encoding encoding)
+{
+    return HASH_KEY(cache_hash_path(s), encoding);
+}
+
+static void
+lru_unlink(struct lru* l, struct cache_entry* e)
+{
+    if(NULL != e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        l->head = e->lru_next;
+    if(NULL != e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        l->tail = e->lru_prev;
+}
+
+static void
+lru_push_front(struct lru* l, struct cache_entry* e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = l->head;
+    if(NULL != l->head)
+        l->head->lru_prev = e;
+    else
+        l->tail = e;
+    l->head = e;
+}
+
+static void
+free_entry(struct cache_entry* e)
+{
+    if(-1 != e->fd)
+        close(e->fd);
+    free(e->body);
+    free(e->header);
+    free(e->uri);
+    free(e);
+}
+
+void
+cache_hold(struct cache_entry* e)
+{
+    ++e->refs;
+}
+
+void
+cache_release(void* e)
+{
+    if(0 == --((struct cache_entry*) e)->refs)
+        free_entry(e);
+}
+
+static void
+remove_entry(struct cache_entry* e)
+{
+    struct cache_entry** pp
+        = &g_cache.buckets[e->hash & (g_cache.nbuckets - 1)];
+
+    while(*pp != e)
+        pp = &(*pp)->h_next;
+    *pp = e->h_next;
+
+    lru_unlink(LRU_OF(e), e);
+    LRU_OF(e)->mem -= e->mem;
+    --g_cache.count;
+    cache_release(e);
+}
+
+static void
+grow_buckets()
+{
+    size_t i;
+    size_t n = g_cache.nbuckets * 2;
+    struct cache_entry** b = calloc(n, sizeof(*b));
+
+    if(NULL == b)
+        return; // longer chains are still correct
+
+    for(i = 0; i < g_cache.nbuckets; ++i)
+    {
+        struct cache_entry* e = g_cache.buckets[i];
+        while(NULL != e)
+        {
+            struct cache_entry* next = e->h_next;
+            e->h_next = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(g_cache.buckets);
+    g_cache.buckets = b;
+    g_cache.nbuckets = n;
+}
+
+int
+cache_init(size_t max_mem, int valid)
+{
+    const struct watch_shared* w = watch_shared();
+
+    memset(&g_cache, 0, sizeof(g_cache));
+    if(0 == max_mem)
+        return 0;
+    if(NULL != w)
+    {
+        g_watch_flush = __atomic_load_n(&w->w_flush, __ATOMIC_ACQUIRE);
+        g_watch_seq = __atomic_load_n(&w->w_seq, __ATOMIC_ACQUIRE);
+    }
+
+    g_cache.buckets = calloc(CACHE_MIN_BUCKETS, sizeof(*g_cache.buckets));
+    if(NULL == g_cache.buckets)
+    {
+        perror("[cache] calloc");
+        return -1;
+    }
+    g_cache.nbuckets = CACHE_MIN_BUCKETS;
+    g_cache.max_mem = max_mem;
+    g_cache.valid = valid;
+    return 0;
+}
+
+static void
+drop_path(unsigned int h)
+{
+    struct cache_entry* e;
+    struct cache_entry* next;
+    unsigned int key;
+    int enc;
+
+    for(enc = ENC_IDENTITY; enc <= ENC_BR; ++enc)
+    {
+        key = HASH_KEY(h, enc);
+        for(e = g_cache.buckets[key & (g_cache.nbuckets - 1)]; e; e = next)
+        {
+            next = e->h_next;
+            // a collision only costs a reload
+            if(e->hash == key)
+                remove_entry(e);
+        }
+    }
+}
+
+static void
+drop_all()
+{
+    while(NULL != g_cache.files.tail)
+        remove_entry(g_cache.files.tail);
+    while(NULL != g_cache.misses.tail)
+        remove_entry(g_cache.misses.tail);
+}
+
+/** Drops the entries of the paths the watcher has seen changing */
+static void
+apply_changes()
+{
+    const struct watch_shared* w = watch_shared();
+    unsigned long flush;
+    unsigned long seq;
+    unsigned long i;
+
+    if(NULL == w)
+        return;
+    flush = __atomic_load_n(&w->w_flush, __ATOMIC_ACQUIRE);
+    seq = __atomic_load_n(&w->w_seq, __ATOMIC_ACQUIRE);
+    if(flush == g_watch_flush && seq == g_watch_seq)
+        return;
+
+    if(flush == g_watch_flush && seq - g_watch_seq <= WATCH_RING_SIZE)
+    {
+        for(i = g_watch_seq; i != seq; ++i)
+            drop_path(__atomic_load_n(&w->w_paths[i & (WATCH_RING_SIZE - 1)],
+                        __ATOMIC_RELAXED));
+        // the paths are only valid if the ring has not wrapped meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&w->w_seq, __ATOMIC_RELAXED) - g_watch_seq
+                <= WATCH_RING_SIZE)
+        {
+            g_watch_seq = seq;
+            return;
+        }
+    }
+    drop_all();
+    g_watch_flush = flush;
+    g_watch_seq = seq;
+}
+
+/** Checks that the file behind the entry has not been replaced */
+static int
+is_fresh(struct cache_entry* e, time_t now)
+{
+    const struct watch_shared* w = watch_shared();
+    struct stat st;
+
+    // the watcher reports changes of the real paths of files
+    if(!e->linked && NULL != w
+            && __atomic_load_n(&w->w_active, __ATOMIC_ACQUIRE))
+        return 1;
+    if(now - e->checked < g_cache.valid)
+        return 1;
+    // a failed lookup is simply tried again
+    if(OK != e->status || 0 != stat_beneath(e->uri, &st)
+            || st.st_ino != e->ino
+            || st.st_size != e->file_size || st.st_mtime != e->mtime
+            || st.st_mtim.tv_nsec != e->mtime_nsec)
+        return 0;
+    e->checked = now;
+    e->variants = -1; // sidecars could have appeared or gone
+    return 1;
+}
+
+struct cache_entry*
+cache_lookup(const char* uri, enum content_encoding encoding)
+{
+    unsigned int h;
+    struct cache_entry* e;
+
+    if(NULL == g_cache.buckets)
+        return NULL;
+
+    apply_changes();
+    h = hash_uri(uri, encoding);
+    for(e = g_cache.buckets[h & (g_cache.nbuckets - 1)]; e; e = e->h_next)
+    {
+        if(e->hash == h && e->encoding == encoding && 0 == strcmp(e->uri, uri))
+        {
+            if(!is_fresh(e, time(NULL)))
+            {
+                remove_entry(e);
+                break;
+            }
+            lru_unlink(LRU_OF(e), e);
+            lru_push_front(LRU_OF(e), e);
+            stats_cache(1);
+            return e;
+        }
+    }
+    stats_cache(0);
+    return NULL;
+}
+
+static int
+read_body(struct cache_entry* e)
+{
+    off_t off = 0;
+    ssize_t n;
+
+    if(NULL == (e->body = malloc(e->size ? e->size : 1)))
+        return -1;
+    while(off < e->size)
+    {
+        n = pread(e->fd, e->body + off, e->size - off, off);
+        if(n <= 0)
+        {
+            free(e->body);
+            e->body = NULL;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void
+put_entry_header(struct cache_entry* e, char* header, size_t size)
+{
+    e->validators_len = put_validators(header, size, e->etag, e->mtime);
+    e->header_len = e->validators_len + snprintf(header + e->validators_len,
+            size - e->validators_len,
+            "Accept-Ranges: bytes\r\n%sContent-type: %s\r\n"
+            "Content-Length: %lld\r\n",
+            e->enc_headers, e->mimetype, (long long) e->size);
+    e->header = header;
+}
+
+void
+cache_describe(struct cache_entry* e, char* header, size_t size,
+               int fd, const struct stat* st,
+               const char* mimetype, enum content_encoding encoding)
+{
+    e->fd = fd;
+    e->fd_offset = 0;
+    e->status = OK;
+    e->size = e->file_size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->ino = st->st_ino;
+    e->mimetype = mimetype;
+    e->encoding = encoding;
+    e->enc_headers = encoding_headers(mimetype, encoding);
+    e->variants = -1;
+    format_etag(e->etag, st);
+    e->body = NULL;
+    put_entry_header(e, header, size);
+}
+
+void
+cache_describe_body(struct cache_entry* e, char* header, size_t size,
+                    const struct cache_entry* src,
+                    enum content_encoding encoding, char* body, size_t len)
+{
+    size_t etag_len = strlen(src->etag);
+
+    e->fd = -1;
+    e->fd_offset = 0;
+    e->status = OK;
+    e->size = len;
+    e->file_size = src->file_size;
+    e->mtime = src->mtime;
+    e->mtime_nsec = src->mtime_nsec;
+    e->ino = src->ino;
+    e->mimetype = src->mimetype;
+    e->encoding = encoding;
+    e->enc_headers = encoding_headers(src->mimetype, encoding);
+    e->variants = 0;
+    e->linked = src->linked;
+    // a strong validator has to differ between encodings
+    snprintf(e->etag, ETAG_SIZE, "%.*s-z\"", (int) etag_len - 1, src->etag);
+    e->body = body;
+    put_entry_header(e, header, size);
+}
+
+static void
+link_entry(struct cache_entry* e)
+{
+    struct lru* l = LRU_OF(e);
+    size_t max_mem = (OK == e->status) ? g_cache.max_mem
+        : g_cache.max_mem / CACHE_MISSES_SHARE;
+
+    while(l->mem + e->mem > max_mem && NULL != l->tail)
+        remove_entry(l->tail);
+
+    if(g_cache.count >= g_cache.nbuckets)
+        grow_buckets();
+    e->h_next = g_cache.buckets[e->hash & (g_cache.nbuckets - 1)];
+    g_cache.buckets[e->hash & (g_cache.nbuckets - 1)] = e;
+    lru_push_front(l, e);
+    l->mem += e->mem;
+    ++g_cache.count;
+    e->refs = 1;
+}
+
+struct cache_entry*
+cache_insert(const char* uri, enum content_encoding encoding,
+             int fd, const struct stat* st, const char* mimetype)
+{
+    char header[384];
+    struct cache_entry* e;
+
+    if(NULL == g_cache.buckets)
+        return NULL;
+
+    if(NULL == (e = calloc(1, sizeof(*e))))
+        return NULL;
+    cache_describe(e, header, sizeof(header), fd, st,
+            mimetype, encoding);
+    e->hash = hash_uri(uri, encoding);
+    e->checked = time(NULL);
+    e->mem = sizeof(*e) + strlen(uri) + 1 + e->header_len + 1
+        + (e->size <= CACHE_BODY_MAX ? e->size : 0);
+    if(e->mem > g_cache.max_mem)
+    {
+        free(e);
+        return NULL;
+    }
+
+    e->uri = strdup(uri);
+    e->header = strdup(header);
+    if(NULL == e->uri || NULL == e->header
+            || (e->size <= CACHE_BODY_MAX && -1 == read_body(e)))
+    {
+        free(e->header);
+        free(e->uri);
+        free(e);
+        return NULL;
+    }
+
+    link_entry(e);
+    return e;
+}
+
+struct cache_entry*
+cache_insert_body(const char* uri, enum content_encoding encoding,
+                  const struct cache_entry* src, char* body, size_t len)
+{
+    char header[384];
+    struct cache_entry* e;
+
+    if(NULL == g_cache.buckets)
+        return NULL;
+
+    if(NULL == (e = calloc(1, sizeof(*e))))
+        return NULL;
+    cache_describe_body(e, header, sizeof(header), src, encoding, body, len);
+    e->hash = hash_uri(uri, encoding);
+    e->checked = time(NULL);
+    e->mem = sizeof(*e) + strlen(uri) + 1 + e->header_len + 1 + len;
+    if(e->mem > g_cache.max_mem
+            || NULL == (e->uri = strdup(uri))
+            || NULL == (e->header = strdup(header)))
+    {
+        free(e->uri);
+        free(e);
+        return NULL;
+    }
+
+    link_entry(e);
+    return e;
+}
+
+struct cache_entry*
+cache_insert_miss(const char* uri, enum content_encoding encoding,
+                  enum HTTP_STATUS status)
+{
+    struct cache_entry* e;
+
+    if(NULL == g_cache.buckets)
+        return NULL;
+
+    if(NULL == (e = calloc(1, sizeof(*e))))
+        return NULL;
+    e->fd = -1;
+    e->encoding = encoding;
+    e->status = status;
+    e->hash = hash_uri(uri, encoding);
+    e->checked = time(NULL);
+    e->mem = sizeof(*e) + strlen(uri) + 1;
+    if(e->mem > g_cache.max_mem / CACHE_MISSES_SHARE
+            || NULL == (e->uri = strdup(uri)))
+    {
+        free(e);
+        return NULL;
+    }
+
+    link_entry(e);
+    return e;
+}
@@ -0,0 +1,99 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "server/handler.h"
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/** Files not bigger than this are kept in memory entirely */
+#define CACHE_BODY_MAX (16 * 1024)
+
+struct cache_entry
+{
+    char* uri;
+    unsigned int hash;
+    int fd;             // -1 if the entry is a compressed copy in memory
+    off_t fd_offset;    // where the file begins in fd, non-zero in a pack
+    off_t size;
+    off_t file_size;    // differs from size for compressed copies
+    time_t mtime;
+    long mtime_nsec;
+    ino_t ino;
+    const char* mimetype;
+    enum content_encoding encoding;
+    const char* enc_headers; // Content-Encoding and Vary lines
+    int variants;       // precompressed sidecars found, -1 if not probed
+    char etag[ETAG_SIZE];
+    char* header;       // validators, then Content-type and Content-Length
+    size_t header_len;
+    size_t validators_len; // ETag and Last-Modified lines for 304
+    char* body;         // NULL unless the file is small
+    time_t checked;     // the last time the entry was validated
+    size_t mem;         // bytes accounted against the cache limit
+    enum HTTP_STATUS status; // OK unless the entry is a failed lookup
+    int linked;         // reached through a symlink, the watcher can miss it
+    int refs;           // the cache's own and those of responses in flight
+
+    struct cache_entry* h_next;
+    struct cache_entry* lru_prev;
+    struct cache_entry* lru_next;
+};
+
+// fills metadata of the entry and writes its header into "header"
+void
+cache_describe(struct cache_entry* e, char* header, size_t size,
+               int fd, const struct stat* st,
+               const char* mimetype, enum content_encoding encoding);
+
+// describes "body" as the "encoding" of the file behind "src"
+void
+cache_describe_body(struct cache_entry* e, char* header, size_t size,
+                    const struct cache_entry* src,
+                    enum content_encoding encoding, char* body, size_t len);
+
+// max_mem == 0 disables the cache; entries are re-validated with stat()
+// if they were not checked for "valid" seconds, unless the watcher of the
+// server process is active and reports the changes
+int
+cache_init(size_t max_mem, int valid);
+
+// the hash of a normalized path the watcher publishes
+unsigned int
+cache_hash_path(const char* path);
+
+// returns NULL on a miss or if the file has been changed; entries are
+// keyed by the path and the encoding the file is served with. An entry
+// whose status is not OK says the file could not be served
+struct cache_entry*
+cache_lookup(const char* uri, enum content_encoding encoding);
+
+// takes ownership of fd on success; returns NULL if the file
+// can not be cached (the caller still owns fd then)
+struct cache_entry*
+cache_insert(const char* uri, enum content_encoding encoding,
+             int fd, const struct stat* st, const char* mimetype);
+
+// caches a compressed copy of "src" under (uri, encoding) and takes
+// ownership of body on success; it is dropped once the file changes
+struct cache_entry*
+cache_insert_body(const char* uri, enum content_encoding encoding,
+                  const struct cache_entry* src, char* body, size_t len);
+
+// keeps the entry, which may be dropped from the cache meanwhile, until
+// cache_release(); for responses sent after the handler returns
+void
+cache_hold(struct cache_entry* e);
+
+void
+cache_release(void* e);
+
+// remembers that the file could not be served, so the error is repeated
+// without looking at the disk until the entry has to be re-validated
+struct cache_entry*
+cache_insert_miss(const char* uri, enum content_encoding encoding,
+                  enum HTTP_STATUS status);
+
+#endif
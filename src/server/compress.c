@@ -0,0 +1,73 @@
+#include "server/compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+static char*
+read_file(int fd, off_t size)
+{
+    off_t off = 0;
+    ssize_t n;
+    char* buf = malloc(size ? size : 1);
+
+    while(NULL != buf && off < size)
+    {
+        if(0 >= (n = pread(fd, buf + off, size - off, off)))
+        {
+            free(buf);
+            return NULL;
+        }
+        off += n;
+    }
+    return buf;
+}
+
+char*
+gzip_file(int fd, const char* body, off_t size, int level, size_t* len)
+{
+    z_stream zs = {0};
+    char* in = (char*) body;
+    char* out = NULL;
+    uLong bound;
+
+    if(size > GZIP_MAX_SIZE)
+        return NULL;
+    if(NULL == in && NULL == (in = read_file(fd, size)))
+        return NULL;
+
+    // 16 + MAX_WBITS makes zlib write a gzip header and trailer
+    if(Z_OK != deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                Z_DEFAULT_STRATEGY))
+    {
+        fprintf(stderr, "[gzip] deflateInit2 failed\n");
+        goto out;
+    }
+    bound = deflateBound(&zs, size);
+    if(NULL == (out = malloc(bound)))
+    {
+        deflateEnd(&zs);
+        goto out;
+    }
+
+    zs.next_in = (Bytef*) in;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = bound;
+    if(Z_STREAM_END != deflate(&zs, Z_FINISH) || zs.total_out >= (uLong) size)
+    {
+        free(out);
+        out = NULL;
+    }
+    else
+    {
+        *len = zs.total_out;
+    }
+    deflateEnd(&zs);
+
+out:
+    if(in != body)
+        free(in);
+    return out;
+}
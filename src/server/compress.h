@@ -0,0 +1,15 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Bigger files are never compressed on the fly */
+#define GZIP_MAX_SIZE (1024 * 1024)
+
+// gzips "size" bytes of "body" or, if it is NULL, of the file "fd";
+// returns a malloc'ed buffer or NULL if the result is not smaller
+char*
+gzip_file(int fd, const char* body, off_t size, int level, size_t* len);
+
+#endif
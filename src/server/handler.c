@@ -1,16 +1,35 @@
+#define _GNU_SOURCE
 #include "config/conf.h"
+#include "server/cache.h"
+#include "server/compress.h"
 #include "server/handler.h"
+#include "server/log.h"
+#include "server/mime.h"
+#include "server/output.h"
+#include "server/pack.h"
+#include "server/stats.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <sys/types.h>
 
+#define OFF_MAX ((off_t) ((1ULL << (sizeof(off_t) * 8 - 1)) - 1))
+#define HEADER_BUF_SIZE 1024
+/** The first guess of the size of a status report, and its growth */
+#define STATUS_BUF_SIZE 4096
+
 /** Config for the whole program */
 extern struct conf g_conf;
 
@@ -25,27 +44,49 @@ const char * const HTTP_VERSION_STRING[] = {
 
 const char * const HTTP_STATUS_ALL[] = {
     "200", "OK",
+    "206", "Partial Content",
+    "304", "Not Modified",
     "400", "Bad Request",
     "403", "Forbidden",
     "404", "Not Found",
+    "416", "Range Not Satisfiable",
     "500", "Internal Server Error",
     "501", "Not Implemented",
     "505", "HTTP Version Not Supported"
 };
 
-const char * const mime[] = {
-    ".html", "text/html",
-    ".htm", "text/html",
-    ".css", "text/css",
-    ".gif", "image/gif",
-    ".png", "image/png",
-    ".jpg", "image/jpeg",
-    ".xml", "application/xml",
-    ".svg", "image/svg+xml",
-    ".txt", "text/plain",
-    "application/octet-stream"
+#define NSTATUS (sizeof(HTTP_STATUS_ALL) / sizeof(*HTTP_STATUS_ALL) / 2)
+
+/** A piece of a response which is not formatted per request */
+struct prebuilt
+{
+    const char* p;
+    size_t len;
+};
+
+#define PREBUILT(s) {s, sizeof(s) - 1}
+
+/** By keep-alive; they end the header */
+static const struct prebuilt CONNECTION_LINES[2] = {
+    PREBUILT("Connection: close\r\n\r\n"),
+    PREBUILT("Connection: keep-alive\r\n\r\n")
 };
 
+/** Built once by handler_init(), indexed by version and status / 2; the
+ *  error pages are whole responses and also by keep-alive */
+static struct prebuilt g_status_lines[V11 + 1][NSTATUS];
+static struct prebuilt g_error_pages[V11 + 1][NSTATUS][2];
+static int g_status_codes[NSTATUS];
+
+/** The document root, which every path is resolved beneath */
+static int g_root_fd = -1;
+/** 0 once the kernel turned out to be older than 5.6 */
+static int g_has_openat2 = 1;
+
+#define STATUS_LINE(http_req) \
+    (&g_status_lines[(http_req)->version][(http_req)->status / 2])
+#define STATUS_CODE(status) (g_status_codes[(status) / 2])
+
 void
 print_http_req(const struct HTTP_REQ* http_req)
 {
@@ -56,276 +97,1225 @@ print_http_req(const struct HTTP_REQ* http_req)
           );
 }
 
-int sendall(int sfd, const char* data, size_t* dsize)
+int
+isslicein(const struct http_slice* str, const char * const set[],
+          size_t latest_el)
 {
-    int total = 0;
-    int bytesleft = *dsize;
-    int n;
+    size_t i;
 
-    while((size_t) total < *dsize)
+    for(i = 0; ; ++i)
     {
-        n = send(sfd, data+total, bytesleft, MSG_NOSIGNAL);
-        if(-1 == n)
+        if(strlen(set[i]) == str->len && 0 == memcmp(str->p, set[i], str->len))
         {
-            break;
+            return i;
+        }
+        else if(i == latest_el)
+        {
+            return -1;
         }
-        total += n;
-        bytesleft -= n;
     }
+}
+
+static const char * const ENCODING_SUFFIX[] = {
+    "", ".gz", ".br"
+};
+
+static const char * const ENCODING_HEADERS[] = {
+    "Vary: Accept-Encoding\r\n",
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n",
+    "Content-Encoding: br\r\nVary: Accept-Encoding\r\n"
+};
+
+const char*
+encoding_headers(const char* mimetype, enum content_encoding encoding)
+{
+    if(ENC_IDENTITY != encoding || mime_compressible(mimetype))
+        return ENCODING_HEADERS[encoding];
+    return "";
+}
 
-    *dsize = total;
+/** Parses a coding of Accept-Encoding: "gzip;q=0.5". Returns 0 if the
+ *  client explicitly refused it with q=0 */
+static int
+coding_quality(const char* t, size_t len)
+{
+    const char* end = t + len;
+    const char* q = memchr(t, ';', len);
 
-    return n == -1 ? -1 : 0;
+    if(NULL == q)
+        return 1;
+    for(++q; q < end && (' ' == *q || '\t' == *q); ++q)
+        ;
+    if(end - q < 3 || 'q' != q[0] || '=' != q[1])
+        return 1;
+    for(q += 2; q < end; ++q)
+    {
+        if('1' <= *q && '9' >= *q)
+            return 1;
+    }
+    return 0;
 }
 
 int
-isstrin(const char* str, const char * const set[], size_t latest_el)
+accepted_encodings(const struct HTTP_REQ* http_req)
 {
-    size_t i;
+    size_t len;
+    size_t tlen;
+    int accepted = 0;
+    const char* end;
+    const char* t;
+    const char* v = find_http_header(http_req, "Accept-Encoding", &len);
 
-    for(i = 0; ; ++i)
+    if(NULL == v)
+        return 0;
+    end = v + len;
+    while(v < end)
     {
-        if(0 == strcmp(str, set[i]))
+        if(' ' == *v || '\t' == *v)
         {
-            return i;
+            ++v;
+            continue;
         }
-        else if(i == latest_el)
+        if(NULL == (t = memchr(v, ',', (size_t) (end - v))))
+            t = end;
+        for(tlen = 0; v + tlen < t && ';' != v[tlen] && ' ' != v[tlen]; ++tlen)
+            ;
+        if(coding_quality(v, (size_t) (t - v)))
         {
-            return -1;
+            if((4 == tlen && 0 == strncasecmp(v, "gzip", 4))
+                    || (6 == tlen && 0 == strncasecmp(v, "x-gzip", 6)))
+                accepted |= ENC_GZIP;
+            else if(2 == tlen && 0 == strncasecmp(v, "br", 2))
+                accepted |= ENC_BR;
+            else if(1 == tlen && '*' == *v)
+                accepted |= ENC_GZIP | ENC_BR;
         }
+        if(t == end)
+            break;
+        v = t + 1;
     }
+    return accepted;
 }
 
-size_t
-content_type(const char *path)
+static int
+set_prebuilt(struct prebuilt* pb, const char* s, size_t len)
 {
-    size_t i;
+    char* p = malloc(len);
 
-    for(i = 0; i < sizeof(mime) / sizeof(*mime); i += 2)
+    if(NULL == p)
     {
-        if(strstr(path, mime[i]))
+        perror("[server] malloc");
+        return -1;
+    }
+    pb->p = memcpy(p, s, len);
+    pb->len = len;
+    return 0;
+}
+
+int
+handler_init()
+{
+    char buf[HEADER_BUF_SIZE];
+    char body[200];
+    const char* code;
+    const char* reason;
+    size_t line;
+    size_t len;
+    int blen;
+    int s;
+    int v;
+    int ka;
+
+    // the workers inherit it
+    g_root_fd = open(g_conf.document_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(-1 == g_root_fd)
+    {
+        perror("[server] open(document_root)");
+        return -1;
+    }
+
+    for(s = 0; s < (int) NSTATUS; ++s)
+    {
+        code = HTTP_STATUS_ALL[2 * s];
+        reason = HTTP_STATUS_ALL[2 * s + 1];
+        g_status_codes[s] = atoi(code);
+        blen = sprintf(body,
+                "<html><title>%s %s</title><body><html><h2>%s: %s</h2></html>",
+                code, reason, code, reason);
+        for(v = V10; v <= V11; ++v)
         {
-            return (size_t) i + 1;
+            line = sprintf(buf, "HTTP/%s %s %s\r\n", HTTP_VERSION_STRING[v],
+                    code, reason);
+            if(-1 == set_prebuilt(&g_status_lines[v][s], buf, line))
+                return -1;
+            if(2 * s < BAD_REQUEST)
+                continue;
+            for(ka = 0; ka < 2; ++ka)
+            {
+                len = line + sprintf(buf + line, "Content-type: text/html\r\n"
+                        "Content-Length: %d\r\n%s%s", blen,
+                        CONNECTION_LINES[ka].p, body);
+                if(-1 == set_prebuilt(&g_error_pages[v][s][ka], buf, len))
+                    return -1;
+            }
         }
     }
-    return (size_t) i - 2;
+    return 0;
+}
+
+static char*
+put_offset(char* buf, off_t n)
+{
+    char digits[24];
+    char* d = digits + sizeof(digits);
+
+    do
+    {
+        *--d = '0' + n % 10;
+        n /= 10;
+    } while(0 != n);
+    return mempcpy(buf, d, digits + sizeof(digits) - d);
 }
 
 size_t
 put_http_header(char* buf, const struct HTTP_REQ* http_req,
-                const char* path)
+                const char* mimetype, off_t content_length, const char* extra)
 {
-    const char* mimetype = (path) ? mime[content_type(path)] : mime[1];
+    const struct prebuilt* line = STATUS_LINE(http_req);
+    const struct prebuilt* conn = &CONNECTION_LINES[0 != http_req->keep_alive];
+    char* p = mempcpy(buf, line->p, line->len);
 
-    sprintf(buf, "HTTP/%s %s %s\r\nContent-type: %s\r\n\r\n",
-            HTTP_VERSION_STRING[http_req->version],
-            HTTP_STATUS_ALL[http_req->status],
-            HTTP_STATUS_ALL[http_req->status + 1],
-            mimetype);
+    if(NULL != extra)
+        p = stpcpy(p, extra);
+    p = stpcpy(stpcpy(p, "Content-type: "), mimetype);
+    p = put_offset(stpcpy(p, "\r\nContent-Length: "), content_length);
+    p = stpcpy(p, "\r\n");
+    p = mempcpy(p, conn->p, conn->len);
+    return p - buf;
+}
 
-    return strlen(buf);
+size_t
+format_etag(char* buf, const struct stat* st)
+{
+    // a strong validator: any change of the file changes one of these
+    return snprintf(buf, ETAG_SIZE, "\"%llx-%llx-%llx\"",
+            (unsigned long long) st->st_ino,
+            (unsigned long long) st->st_size,
+            (unsigned long long) st->st_mtim.tv_sec * 1000000000ULL
+                + st->st_mtim.tv_nsec);
 }
 
-void
-get_rid_of_cgi(char* uri)
+size_t
+put_validators(char* buf, size_t size, const char* etag, time_t mtime)
 {
-    int i;
-    for(i = 0; i < URI_SIZE; ++i)
+    char date[64];
+    struct tm tm;
+
+    gmtime_r(&mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    return snprintf(buf, size, "ETag: %s\r\nLast-Modified: %s\r\n",
+            etag, date);
+}
+
+static int
+etag_matches(const char* value, size_t len, const char* etag)
+{
+    size_t elen = strlen(etag);
+    const char* end = value + len;
+
+    while(value < end)
     {
-        if('?' == *uri)
-        {
-            *uri = '\0';
-            break;
-        }
-        uri++;
+        while(value < end && (' ' == *value || '\t' == *value || ',' == *value))
+            ++value;
+        if(value < end && '*' == *value)
+            return 1;
+        // If-None-Match uses the weak comparison
+        if(end - value > 2 && 'W' == value[0] && '/' == value[1])
+            value += 2;
+        if((size_t) (end - value) >= elen && 0 == memcmp(value, etag, elen))
+            return 1;
+        while(value < end && ',' != *value)
+            ++value;
+    }
+    return 0;
+}
+
+int
+is_not_modified(const struct HTTP_REQ* http_req,
+                const char* etag, time_t mtime)
+{
+    size_t len;
+    const char* v;
+    char date[64];
+    struct tm tm;
+
+    if(NULL != (v = find_http_header(http_req, "If-None-Match", &len)))
+        return etag_matches(v, len, etag);
+
+    v = find_http_header(http_req, "If-Modified-Since", &len);
+    if(NULL != v && len < sizeof(date))
+    {
+        memcpy(date, v, len);
+        date[len] = '\0';
+        memset(&tm, 0, sizeof(tm));
+        v = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if(NULL != v && '\0' == *v)
+            return mtime <= timegm(&tm);
+    }
+    return 0;
+}
+
+const char*
+find_http_header(const struct HTTP_REQ* http_req, const char* name,
+                 size_t* len)
+{
+    const struct http_slice* v;
+
+    if(NULL == http_req->parser
+            || NULL == (v = http_parser_header(http_req->parser, name)))
+        return NULL;
+    *len = v->len;
+    return v->p;
+}
+
+int
+has_http_token(const char* value, size_t len, const char* token)
+{
+    size_t tlen = strlen(token);
+    const char* end = value + len;
+
+    while(value < end)
+    {
+        while(value < end && (' ' == *value || '\t' == *value || ',' == *value))
+            ++value;
+        const char* t = value;
+        while(value < end && ',' != *value)
+            ++value;
+        const char* e = value;
+        while(e > t && (' ' == e[-1] || '\t' == e[-1]))
+            --e;
+        if((size_t) (e - t) == tlen && 0 == strncasecmp(t, token, tlen))
+            return 1;
     }
+    return 0;
+}
+
+static void
+set_keep_alive(struct HTTP_REQ* http_req)
+{
+    size_t len;
+    const char* v = find_http_header(http_req, "Connection", &len);
+
+    // HTTP/1.1 connections are persistent unless the client says otherwise,
+    // HTTP/1.0 ones have to ask for it explicitly
+    if(V11 == http_req->version)
+        http_req->keep_alive = !(v && has_http_token(v, len, "close"));
+    else
+        http_req->keep_alive = v && has_http_token(v, len, "keep-alive");
 }
 
 int
-fill_http_req(struct HTTP_REQ* http_req, const char* method,
-        char* uri, char v1, char v2)
+parse_http_req(struct HTTP_REQ* http_req, const struct http_parser* p)
 {
     int rv;
-    enum HTTP_METHOD http_method;
-    enum HTTP_VERSION http_version;
+    char* q;
+    struct http_slice version;
 
-    if(-1 == (rv = isstrin(method, HTTP_METHOD_STRING, HEAD)))
+    if(-1 == (rv = isslicein(&p->method, HTTP_METHOD_STRING, HEAD)))
     {
         http_req->status = BAD_REQUEST;
         return -1;
     }
-    http_method = (unsigned int) rv;
+    http_req->method = rv;
 
-    const char version[] = {v1, '.', v2, '\0'};
-    if(-1 == (rv = isstrin(version, HTTP_VERSION_STRING, V11)))
+    if(p->version.len < 5 || 0 != memcmp(p->version.p, "HTTP/", 5))
+    {
+        http_req->status = BAD_REQUEST;
+        return -1;
+    }
+    version.p = p->version.p + 5;
+    version.len = p->version.len - 5;
+    if(-1 == (rv = isslicein(&version, HTTP_VERSION_STRING, V11)))
     {
         http_req->status = HTTP_VER;
         return -1;
     }
-    http_version = (unsigned int) rv;
+    http_req->version = rv;
+    http_req->parser = p;
+    set_keep_alive(http_req);
+
+    // the parser has NUL-terminated the URI in place
+    http_req->uri = (char*) p->uri.p;
+    if(NULL != (q = strchr(http_req->uri, '#')))
+    {
+        *q = '\0';
+    }
+    if(NULL != (q = strchr(http_req->uri, '?')))
+    {
+        *q = '\0';
+        http_req->query = q + 1;
+    }
+
+    return 0;
+}
 
-    http_req->method = http_method;
-    http_req->version = http_version;
+static ssize_t
+splice_file(int sfd, int fd, off_t* offset, size_t count)
+{
+    static int pipefd[2] = {-1, -1};
+    off_t in = *offset;
+    ssize_t n;
+    ssize_t k;
+    ssize_t sent = 0;
+    int err;
 
-    get_rid_of_cgi(uri);
-    memset(http_req->uri, 0, sizeof(http_req->uri));
-    strncpy(http_req->uri, uri, URI_SIZE);
-    if(http_req->uri[URI_SIZE - 1] != '\0')
+    if(-1 == pipefd[0] && -1 == pipe2(pipefd, O_CLOEXEC))
     {
-        // path is too long, but the request itself is okay
-        http_req->status = INTERNAL_ERROR;
-        //http_req->uri[URI_SIZE - 1] = '\0';
+        perror("pipe2()");
         return -1;
     }
-    free(uri);
 
-    return 0;
+    n = splice(fd, &in, pipefd[1], NULL, count,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(n <= 0)
+    {
+        return n;
+    }
+    while(sent < n)
+    {
+        k = splice(pipefd[0], NULL, sfd, NULL, n - sent,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(-1 == k)
+        {
+            if(EINTR == errno)
+                continue;
+            // the pipe must be drained, otherwise the next call would
+            // send stale data to another client
+            err = errno;
+            close(pipefd[0]);
+            close(pipefd[1]);
+            pipefd[0] = pipefd[1] = -1;
+            errno = err;
+            break;
+        }
+        sent += k;
+    }
+    *offset += sent;
+    return (0 < sent) ? sent : -1;
+}
+
+static ssize_t
+copy_file(int sfd, int fd, off_t* offset, size_t count)
+{
+    char buf[DEF_BUF_SIZE];
+    ssize_t n;
+
+    if(count > sizeof(buf))
+        count = sizeof(buf);
+    if(0 < (n = pread(fd, buf, count, *offset))
+            && 0 < (n = send(sfd, buf, n, MSG_NOSIGNAL)))
+    {
+        *offset += n;
+    }
+    return n;
+}
+
+ssize_t
+send_file(int sfd, int fd, off_t* offset, size_t count,
+          enum file_transfer* how)
+{
+    ssize_t n;
+
+    while(1)
+    {
+        switch(*how)
+        {
+            case TRANSFER_SENDFILE:
+                n = sendfile(sfd, fd, offset, count);
+                break;
+            case TRANSFER_SPLICE:
+                n = splice_file(sfd, fd, offset, count);
+                break;
+            default:
+                n = copy_file(sfd, fd, offset, count);
+        }
+
+        if(-1 != n)
+        {
+            return n;
+        }
+        else if(EINTR == errno)
+        {
+            continue;
+        }
+        else if((EINVAL == errno || ENOSYS == errno)
+                && TRANSFER_COPY != *how)
+        {
+            // the file system does not support zero-copy transfer
+            *how = (TRANSFER_SENDFILE == *how) ? TRANSFER_SPLICE
+                                               : TRANSFER_COPY;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+}
+
+static const struct prebuilt*
+connection_line(const struct HTTP_REQ* http_req)
+{
+    return &CONNECTION_LINES[0 != http_req->keep_alive];
+}
+
+static int
+send_body(struct out_queue* out, const struct cache_entry* e,
+          off_t offset, off_t count)
+{
+    if(NULL != e->body)
+        return out_ref(out, e->body + offset, count);
+    return out_file(out, e->fd, e->fd_offset + offset, count);
+}
+
+static off_t
+parse_offset(const char** p, const char* end)
+{
+    off_t n = 0;
+    const char* s = *p;
+
+    while(s < end && '0' <= *s && '9' >= *s)
+    {
+        if(n > (OFF_MAX - 9) / 10)
+            return -1;
+        n = n * 10 + (*s++ - '0');
+    }
+    if(s == *p)
+        return -1;
+    *p = s;
+    return n;
 }
 
 int
-parse_http_req(struct HTTP_REQ* http_req, const char* req)
+parse_ranges(const char* value, size_t len, off_t size,
+             struct byte_range* ranges)
+{
+    int n = 0;
+    off_t first;
+    off_t last;
+    const char* end = value + len;
+
+    if(len < 6 || 0 != strncasecmp(value, "bytes=", 6))
+        return -1;
+    value += 6;
+
+    while(value < end)
+    {
+        while(value < end && (' ' == *value || '\t' == *value))
+            ++value;
+        if(value < end && '-' == *value)
+        {
+            // the last N bytes
+            ++value;
+            if(-1 == (last = parse_offset(&value, end)))
+                return -1;
+            first = (last < size) ? size - last : 0;
+            last = (0 != last) ? size - 1 : -1;
+        }
+        else
+        {
+            if(-1 == (first = parse_offset(&value, end))
+                    || value >= end || '-' != *value++)
+                return -1;
+            if(value < end && '0' <= *value && '9' >= *value)
+            {
+                if(-1 == (last = parse_offset(&value, end)) || last < first)
+                    return -1;
+            }
+            else
+            {
+                last = OFF_MAX;
+            }
+        }
+
+        if(first < size && first <= last)
+        {
+            if(MAX_RANGES == n)
+                return -1; // too many of them, send the whole file
+            ranges[n].first = first;
+            ranges[n].last = (last < size) ? last : size - 1;
+            ++n;
+        }
+
+        while(value < end && (' ' == *value || '\t' == *value))
+            ++value;
+        if(value < end && ',' != *value++)
+            return -1;
+    }
+    return n;
+}
+
+/** A range request is only honored if the representation named in
+ *  If-Range is still the current one */
+static int
+is_range_valid(const struct HTTP_REQ* http_req, const struct cache_entry* e)
+{
+    size_t len;
+    char date[64];
+    struct tm tm;
+    const char* v = find_http_header(http_req, "If-Range", &len);
+
+    if(NULL == v)
+        return 1;
+    if('"' == *v)
+        return strlen(e->etag) == len && 0 == memcmp(v, e->etag, len);
+    if(len >= sizeof(date))
+        return 0;
+    memcpy(date, v, len);
+    date[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    v = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return NULL != v && '\0' == *v && timegm(&tm) == e->mtime;
+}
+
+static void
+send_range(struct out_queue* out, struct HTTP_REQ* http_req,
+           const struct cache_entry* e, const struct byte_range* r)
 {
-    char method[9];
-    char* uri = NULL;
-    char v1 = 0;
-    char v2 = 0;
+    char buf[HEADER_BUF_SIZE];
+    const struct prebuilt* line;
+    const struct prebuilt* conn = connection_line(http_req);
+    char* p;
+    off_t count = r->last - r->first + 1;
+
+    http_req->status = PARTIAL_CONTENT;
+    line = STATUS_LINE(http_req);
+    p = mempcpy(buf, line->p, line->len);
+    p = mempcpy(p, e->header, e->validators_len);
+    p = stpcpy(stpcpy(p, "Accept-Ranges: bytes\r\n"), e->enc_headers);
+    p = stpcpy(stpcpy(p, "Content-type: "), e->mimetype);
+    p = put_offset(stpcpy(p, "\r\nContent-Range: bytes "), r->first);
+    p = put_offset(stpcpy(p, "-"), r->last);
+    p = put_offset(stpcpy(p, "/"), e->size);
+    p = put_offset(stpcpy(p, "\r\nContent-Length: "), count);
+    p = mempcpy(stpcpy(p, "\r\n"), conn->p, conn->len);
+
+    if(-1 == out_append(out, buf, p - buf)
+            || -1 == send_body(out, e, r->first, count))
+    {
+        http_req->keep_alive = 0;
+    }
+}
+
+static size_t
+put_part_header(char* buf, const char* boundary,
+                const struct cache_entry* e, const struct byte_range* r)
+{
+    return sprintf(buf, "\r\n--%s\r\nContent-type: %s\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+            boundary, e->mimetype, (long long) r->first,
+            (long long) r->last, (long long) e->size);
+}
+
+static void
+send_multirange(struct out_queue* out, struct HTTP_REQ* http_req,
+                const struct cache_entry* e,
+                const struct byte_range* ranges, int n)
+{
+    char buf[HEADER_BUF_SIZE];
+    char boundary[ETAG_SIZE + sizeof("webserver-")];
+    const struct prebuilt* line;
+    size_t size;
+    off_t total = 0;
+    int i;
 
+    // the ETag without its quotes
+    snprintf(boundary, sizeof(boundary), "webserver-%.*s",
+            (int) strlen(e->etag) - 2, e->etag + 1);
+
+    for(i = 0; i < n; ++i)
+    {
+        total += put_part_header(buf, boundary, e, &ranges[i]);
+        total += ranges[i].last - ranges[i].first + 1;
+    }
+    total += sprintf(buf, "\r\n--%s--\r\n", boundary);
+
+    http_req->status = PARTIAL_CONTENT;
+    line = STATUS_LINE(http_req);
+    memcpy(buf, line->p, line->len);
+    size = line->len;
+    memcpy(buf + size, e->header, e->validators_len);
+    size += e->validators_len;
+    size += sprintf(buf + size, "Accept-Ranges: bytes\r\n%s"
+            "Content-type: multipart/byteranges; boundary=%s\r\n"
+            "Content-Length: %lld\r\n%s",
+            e->enc_headers, boundary, (long long) total,
+            connection_line(http_req)->p);
+
+    for(i = 0; i < n; ++i)
+    {
+        size += put_part_header(buf + size, boundary, e, &ranges[i]);
+        if(-1 == out_append(out, buf, size)
+                || -1 == send_body(out, e, ranges[i].first,
+                    ranges[i].last - ranges[i].first + 1))
+        {
+            http_req->keep_alive = 0;
+            return;
+        }
+        size = 0;
+    }
+    size = sprintf(buf, "\r\n--%s--\r\n", boundary);
+    if(-1 == out_append(out, buf, size))
+        http_req->keep_alive = 0;
+}
+
+/** Queues a file described by the entry. The header is assembled from
+ *  the prebuilt part of the entry, which is queued by reference along
+ *  with a small body */
+static void
+send_entry(struct out_queue* out, struct HTTP_REQ* http_req,
+           struct cache_entry* e)
+{
+    const struct prebuilt* line;
+    const struct prebuilt* conn;
+    size_t len;
+    const char* v;
+    const char* vary;
+    struct byte_range ranges[MAX_RANGES];
     int n;
-    errno = 0;
-    const char* fstr = "%8[A-Z] %m[-A-Za-z0-9./_~:#@!$'()*+,;?=] HTTP/%c.%c";
-    if(4 == (n = sscanf(req, fstr, method, &uri, &v1, &v2)))
+
+    http_req->status = OK;
+    if(is_not_modified(http_req, e->etag, e->mtime))
     {
-        return fill_http_req(http_req, method, uri, v1, v2);
+        http_req->status = NOT_MODIFIED;
     }
-    else if(0 < n)
+    else if(NULL != (v = find_http_header(http_req, "Range", &len))
+            && is_range_valid(http_req, e)
+            && -1 != (n = parse_ranges(v, len, e->size, ranges)))
     {
-        fprintf(stderr, "Not all values were matched\n");
-        if(NULL != uri)
+        if(0 == n)
         {
-            free(uri);
+            // error_http() answers with the Content-Range it needs
+            http_req->status = RANGE_NOT_SATISFIABLE;
+            http_req->resource_size = e->size;
         }
-        http_req->status = BAD_REQUEST;
+        else if(1 == n)
+            send_range(out, http_req, e, &ranges[0]);
+        else
+            send_multirange(out, http_req, e, ranges, n);
+        return;
     }
-    else if(0 == n && 0 == errno)
+
+    line = STATUS_LINE(http_req);
+    conn = connection_line(http_req);
+    // a 304 carries the Vary of the 200 it stands for, without the rest
+    // of the representation headers
+    vary = (NOT_MODIFIED == http_req->status && '\0' != *e->enc_headers)
+        ? ENCODING_HEADERS[ENC_IDENTITY] : "";
+    if(-1 == out_append(out, line->p, line->len)
+            || -1 == out_ref(out, e->header,
+                (NOT_MODIFIED == http_req->status)
+                    ? e->validators_len
+                    : e->header_len)
+            || ('\0' != *vary && -1 == out_ref(out, vary, strlen(vary)))
+            || -1 == out_ref(out, conn->p, conn->len)
+            || (NOT_MODIFIED != http_req->status
+                && -1 == send_body(out, e, 0, e->size)))
     {
-        fprintf(stderr, "No matching values\n");
-        http_req->status = BAD_REQUEST;
+        http_req->keep_alive = 0;
     }
-    else
+}
+
+int
+normalize_path(const char* uri, char* buf, size_t size)
+{
+    size_t n = 0;
+    size_t len;
+    const char* seg;
+
+    for(seg = uri; '\0' != *seg; seg += len)
     {
-        perror("scanf()");
-        http_req->status = INTERNAL_ERROR;
+        while('/' == *seg)
+            ++seg;
+        len = strcspn(seg, "/");
+        if(0 == len || (1 == len && '.' == seg[0]))
+            continue;
+        if(2 == len && '.' == seg[0] && '.' == seg[1])
+        {
+            if(0 == n)
+                return -1; // above the document root
+            for(--n; 0 < n && '/' != buf[n - 1]; --n)
+                ;
+            continue;
+        }
+        if(n + len + 2 > size)
+            return -1;
+        memcpy(buf + n, seg, len);
+        n += len;
+        if('/' == seg[len])
+            buf[n++] = '/';
     }
-    
-    return -1;
+    if(0 == n)
+        buf[n++] = '.';
+    buf[n] = '\0';
+    return 0;
 }
 
-void
-do_http_get(int sfd, struct HTTP_REQ* http_req)
+int
+open_beneath(const char* path, int* linked)
 {
-    char buf[DEF_BUF_SIZE];
-    size_t ssize;
+    struct open_how how;
     int fd;
-    int n;
 
-    char* path = strcmp(http_req->uri, "/")
-            ? http_req->uri
-            : g_conf.index_page;
+    if(g_has_openat2)
+    {
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+        fd = syscall(SYS_openat2, g_root_fd, path, &how, sizeof(how));
+        *linked = (-1 == fd && ELOOP == errno);
+        if(*linked)
+        {
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+            fd = syscall(SYS_openat2, g_root_fd, path, &how, sizeof(how));
+        }
+        if(-1 != fd || ENOSYS != errno)
+            return fd;
+        // the kernel is older than 5.6, the chroot still holds
+        g_has_openat2 = 0;
+    }
+    *linked = 1;
+    return openat(g_root_fd, path, O_RDONLY | O_CLOEXEC);
+}
 
-    printf("path = %s\n", path);
+int
+stat_beneath(const char* path, struct stat* st)
+{
+    struct open_how how;
+    int fd;
+    int rv;
 
-    fd = open(path, O_RDONLY);
-    if(-1 != fd)
+    if(g_has_openat2)
     {
-        http_req->status = OK;
+        // resolved as open_beneath() does, so a file is not checked
+        // through a symlink which it would refuse
+        memset(&how, 0, sizeof(how));
+        how.flags = O_PATH | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, g_root_fd, path, &how, sizeof(how));
+        if(-1 != fd)
+        {
+            rv = fstat(fd, st);
+            close(fd);
+            return rv;
+        }
+        if(ENOSYS != errno)
+            return -1;
+        g_has_openat2 = 0;
     }
-    else
+    return fstatat(g_root_fd, path, st, 0);
+}
+
+/** Looks the file up in the cache or opens it. A file which can not be
+ *  cached is described by "tmp", and the caller has to close its fd.
+ *  Returns NULL if the file can not be served. */
+static struct cache_entry*
+get_entry(struct HTTP_REQ* http_req, const char* path,
+          enum content_encoding encoding, const char* mimetype,
+          struct cache_entry* tmp, char* header, size_t size)
+{
+    struct cache_entry* e;
+    struct stat st;
+    int linked;
+    int fd;
+
+    if(NULL != (e = cache_lookup(path, encoding)))
+    {
+        if(OK != e->status)
+        {
+            http_req->status = e->status;
+            return NULL;
+        }
+        return e;
+    }
+
+    fd = open_beneath(path, &linked);
+    if(-1 == fd || 0 != fstat(fd, &st))
     {
         switch(errno)
         {
             case EACCES:
+            case EXDEV: // a symlink out of the document root
                 http_req->status = FORBIDDDEN;
-                return;
-            default: // ENOENT
+                break;
+            case ENOENT:
+            case ENOTDIR:
                 http_req->status = NOT_FOUND;
-                return;
+                break;
+            default:
+                http_req->status = INTERNAL_ERROR;
         }
+        if(-1 != fd)
+            close(fd);
+        // the same again is answered without a look at the disk
+        if(INTERNAL_ERROR != http_req->status && NULL != (e
+                    = cache_insert_miss(path, encoding, http_req->status)))
+            e->linked = linked;
+        return NULL;
+    }
+
+    if(!S_ISREG(st.st_mode))
+    {
+        http_req->status = NOT_FOUND;
+        close(fd);
+        if(NULL != (e = cache_insert_miss(path, encoding, http_req->status)))
+            e->linked = linked;
+        return NULL;
+    }
+
+    if(NULL != (e = cache_insert(path, encoding, fd, &st, mimetype)))
+    {
+        e->linked = linked;
+        return e;
+    }
+
+    // the file is not cacheable, describe it just for this response
+    cache_describe(tmp, header, size, fd, &st, mimetype, encoding);
+    return tmp;
+}
+
+/** Finds out which precompressed sidecars (file.gz, file.br) exist */
+static int
+probe_variants(const char* path)
+{
+    char vpath[PATH_MAX];
+    struct stat st;
+    int variants = 0;
+    int enc;
+
+    for(enc = ENC_GZIP; enc <= ENC_BR; enc <<= 1)
+    {
+        if((size_t) snprintf(vpath, sizeof(vpath), "%s%s", path,
+                    ENCODING_SUFFIX[enc]) < sizeof(vpath)
+                && 0 == stat_beneath(vpath, &st) && S_ISREG(st.st_mode))
+            variants |= enc;
+    }
+    return variants;
+}
+
+/** Marks an entry in "variants" which did not shrink with gzip, so it is
+ *  not compressed again until the entry is re-validated */
+#define GZIP_USELESS 0x100
+
+/** Compresses the file on the fly; the result stays in the cache until
+ *  the file changes. A copy which can not be cached is described by
+ *  "tmp", and the caller has to free its body. */
+static struct cache_entry*
+gzip_entry(const char* path, struct cache_entry* e,
+           struct cache_entry* tmp, char* header, size_t size)
+{
+    struct cache_entry* v;
+    char* body;
+    size_t len;
+
+    if(NULL != (v = cache_lookup(path, ENC_GZIP)))
+        return v;
+    body = gzip_file(e->fd, e->body, e->size, g_conf.gzip_comp_level, &len);
+    if(NULL == body)
+    {
+        e->variants |= GZIP_USELESS;
+        return NULL;
+    }
+    if(NULL != (v = cache_insert_body(path, ENC_GZIP, e, body, len)))
+        return v;
+    cache_describe_body(tmp, header, size, e, ENC_GZIP, body, len);
+    return tmp;
+}
+
+/** Describes the representation of a packed file which suits the client.
+ *  The entry points into the mapping of the pack, which outlives every
+ *  response, so there is nothing to pin or release afterwards. */
+static void
+describe_packed(struct cache_entry* e, const struct pack_entry* pe,
+                const struct HTTP_REQ* http_req)
+{
+    const char* base = pack_base();
+    const struct pack_variant* v;
+    int accepted = (0 != pe->e_variants) ? accepted_encodings(http_req) : 0;
+    int enc;
+
+    // brotli is preferred as it is usually smaller
+    for(enc = ENC_BR; enc >= ENC_GZIP; enc >>= 1)
+    {
+        if(0 != (accepted & pe->e_variants & enc))
+            break;
+    }
+    v = &pe->e_v[enc];
+
+    memset(e, 0, sizeof(*e));
+    e->fd = pack_fd();
+    e->fd_offset = v->v_body;
+    e->size = e->file_size = v->v_size;
+    e->mtime = pe->e_mtime;
+    e->mimetype = base + pe->e_mimetype;
+    e->encoding = enc;
+    e->enc_headers = encoding_headers(e->mimetype, enc);
+    e->variants = pe->e_variants;
+    snprintf(e->etag, sizeof(e->etag), "%s", base + v->v_etag);
+    e->header = (char*) base + v->v_header;
+    e->header_len = v->v_header_len;
+    e->validators_len = v->v_validators_len;
+    // a small body goes out with the header in one write
+    if(v->v_size <= CACHE_BODY_MAX)
+        e->body = (char*) base + v->v_body;
+    e->status = OK;
+}
+
+static int
+hold_entry(struct out_queue* out, struct cache_entry* e)
+{
+    cache_hold(e);
+    if(-1 == out_hold(out, cache_release, e))
+    {
+        cache_release(e);
+        return -1;
     }
-    
-    size_t h = put_http_header(buf, http_req, path);
+    return 0;
+}
+
+void
+do_http_get(struct out_queue* out, struct HTTP_REQ* http_req)
+{
+    char header[384];
+    char vheader[384];
+    char path[PATH_MAX];
+    char vpath[PATH_MAX];
+    struct cache_entry tmp;
+    struct cache_entry vtmp;
+    struct cache_entry* e;
+    struct cache_entry* v = NULL;
+    struct cache_entry* served;
+    const struct pack_entry* pe;
+    const char* mimetype;
+    int accepted;
+    int enc;
+
+    const char* uri = strcmp(http_req->uri, "/")
+            ? http_req->uri
+            : g_conf.index_page;
 
-    while(0 != (n = read(fd, buf + h, DEF_BUF_SIZE - h)))
+    if(-1 == normalize_path(uri, path, sizeof(path)))
     {
-        if(n != -1)
+        http_req->status = BAD_REQUEST;
+        return;
+    }
+    debug_printf("path = %s\n", path);
+
+    // files which are not in the pack are looked up in the document root
+    if(NULL != (pe = pack_find(path)))
+    {
+        describe_packed(&tmp, pe, http_req);
+        send_entry(out, http_req, &tmp);
+        return;
+    }
+
+    mimetype = mime_type(path);
+    e = get_entry(http_req, path, ENC_IDENTITY, mimetype,
+            &tmp, header, sizeof(header));
+    if(NULL == e)
+    {
+        return;
+    }
+
+    if(mime_compressible(mimetype) && 0 != (accepted
+                = accepted_encodings(http_req)))
+    {
+        if(-1 == e->variants)
         {
-            ssize = n + h;
-            if(-1 != sendall(sfd, buf, &ssize))
-            {
-                h = 0;
-            }
-            else
+            e->variants = probe_variants(path);
+        }
+        // brotli is preferred as it is usually smaller
+        for(enc = ENC_BR; enc >= ENC_GZIP && NULL == v; enc >>= 1)
+        {
+            if(0 != (accepted & e->variants & enc))
             {
-                fprintf(stderr, "%d: exp %ld, sent %ld\n", sfd, n + h, ssize);
-                break;
+                snprintf(vpath, sizeof(vpath), "%s%s", path,
+                        ENCODING_SUFFIX[enc]);
+                v = get_entry(http_req, vpath, enc, mimetype,
+                        &vtmp, vheader, sizeof(vheader));
+                // a vanished sidecar falls back to the original file
+                http_req->status = OK;
             }
         }
-        else
+        if(NULL == v && g_conf.gzip_on && 0 != (accepted & ENC_GZIP)
+                && 0 == (e->variants & GZIP_USELESS)
+                && (size_t) e->size >= g_conf.gzip_min)
         {
-            perror("read()"); // Internal Server Error
-            break;
+            v = gzip_entry(path, e, &vtmp, vheader, sizeof(vheader));
         }
     }
 
-    close(fd);
+    served = (NULL != v) ? v : e;
+    send_entry(out, http_req, served);
+
+    // the io_uring engine sends once other requests have been handled,
+    // which could drop a cached entry meanwhile
+    if(ENGINE_URING == g_conf.engine && &tmp != served && &vtmp != served
+            && -1 == hold_entry(out, served) && -1 == out_pin(out))
+        http_req->keep_alive = 0;
+
+    // the response may refer to the entries which are released here
+    if((&vtmp == v || &tmp == e) && -1 == out_pin(out))
+        http_req->keep_alive = 0;
+    if(&vtmp == v)
+    {
+        if(-1 != vtmp.fd)
+            close(vtmp.fd);
+        free(vtmp.body);
+    }
+    if(&tmp == e)
+        close(tmp.fd);
 }
 
 void
-do_http_req(int sfd, struct HTTP_REQ* http_req)
+do_http_status(struct out_queue* out, struct HTTP_REQ* http_req)
+{
+    char header[HEADER_BUF_SIZE];
+    const struct stats_segment* seg = stats_shared();
+    int json = NULL != http_req->query && 0 == strcmp(http_req->query, "json");
+    size_t size = STATUS_BUF_SIZE;
+    size_t len;
+    size_t hlen;
+    char* body = NULL;
+    char* p;
+
+    if(NULL == seg)
+    {
+        http_req->status = INTERNAL_ERROR;
+        return;
+    }
+    // the workers keep counting, so only the length of the very report
+    // which has been written is right; a longer one is written again
+    while(1)
+    {
+        if(NULL == (p = realloc(body, size)))
+        {
+            free(body);
+            http_req->status = INTERNAL_ERROR;
+            return;
+        }
+        body = p;
+        if((len = stats_format(seg, body, size, json)) < size)
+            break;
+        size = len + STATUS_BUF_SIZE;
+    }
+
+    http_req->status = OK;
+    hlen = put_http_header(header, http_req,
+            json ? "application/json" : "text/plain", len,
+            "Cache-Control: no-store\r\n");
+    if(-1 == out_append(out, header, hlen)
+            || -1 == out_append(out, body, len))
+    {
+        http_req->keep_alive = 0;
+    }
+    free(body);
+}
+
+void
+do_http_req(struct out_queue* out, struct HTTP_REQ* http_req)
 {
     switch(http_req->method)
     {
         case GET:
-            do_http_get(sfd, http_req);
+            if(g_conf.status_on && 0 == strcmp(http_req->uri,
+                        g_conf.status_uri))
+                do_http_status(out, http_req);
+            else
+                do_http_get(out, http_req);
             break;
         default:
             http_req->status = NOT_IMPLEMENTED;
     }
 
-    if(OK != http_req->status)
+    if(BAD_REQUEST <= http_req->status)
     {
-        error_http(sfd, http_req);
+        error_http(out, http_req);
     }
 }
 
 void
-error_http(int sfd, const struct HTTP_REQ* http_req)
+error_http(struct out_queue* out, struct HTTP_REQ* http_req)
 {
-    char resp[300];
-    size_t size;
+    const struct prebuilt* line = STATUS_LINE(http_req);
+    const struct prebuilt* page;
+    char range[64];
+    char* p;
+    int rv;
 
-    size = put_http_header(resp, http_req, NULL);
+    switch(http_req->status)
+    {
+        case FORBIDDDEN:
+        case NOT_FOUND:
+        case RANGE_NOT_SATISFIABLE:
+            break;
+        default:
+            // the rest of the stream cannot be trusted anymore
+            http_req->keep_alive = 0;
+    }
 
-    sprintf(resp + size,
-            "<html><title>%s %s</title><body><html><h2>%s: %s</h2></html>",
-            HTTP_STATUS_ALL[http_req->status],
-            HTTP_STATUS_ALL[http_req->status + 1],
-            HTTP_STATUS_ALL[http_req->status],
-            HTTP_STATUS_ALL[http_req->status + 1]);
-    size = strlen(resp);
-    sendall(sfd, resp, &size);
+    page = &g_error_pages[http_req->version][http_req->status / 2]
+        [0 != http_req->keep_alive];
+    if(RANGE_NOT_SATISFIABLE == http_req->status)
+    {
+        // the only line which depends on the request
+        p = put_offset(stpcpy(range, "Content-Range: bytes */"),
+                http_req->resource_size);
+        p = stpcpy(p, "\r\n");
+        rv = out_append(out, page->p, line->len);
+        if(-1 != rv && -1 != (rv = out_append(out, range, p - range)))
+            rv = out_append(out, page->p + line->len, page->len - line->len);
+    }
+    else
+    {
+        rv = out_append(out, page->p, page->len);
+    }
+    if(-1 == rv)
+    {
+        http_req->keep_alive = 0;
+    }
 }
 
 void
-make_response(int sfd, const char* data)
+error_response(struct out_queue* out, enum HTTP_STATUS status)
+{
+    struct HTTP_REQ http_req;
+
+    memset(&http_req, 0, sizeof(http_req));
+    http_req.version = V10;
+    http_req.status = status;
+    error_http(out, &http_req);
+    stats_response(STATUS_CODE(status));
+}
+
+int
+make_response(struct out_queue* out, const struct http_parser* p,
+              int persist, int* code)
 {
     struct HTTP_REQ http_req;
 
-    if(0 == parse_http_req(&http_req, data))
+    memset(&http_req, 0, sizeof(http_req));
+    http_req.version = V10;
+    if(0 == parse_http_req(&http_req, p))
     {
-        do_http_req(sfd, &http_req);
+        http_req.keep_alive &= persist;
+        do_http_req(out, &http_req);
     }
     else
     {
-        error_http(sfd, &http_req);
+        error_http(out, &http_req);
     }
+    *code = STATUS_CODE(http_req.status);
+    stats_response(*code);
+    return http_req.keep_alive;
 }
@@ -1,66 +1,161 @@
 #ifndef HANDLER_H
 #define HANDLER_H
 
+#include "server/parser.h"
+
 #include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #define DEF_BUF_SIZE 512
-#define URI_SIZE 256
+#define MAX_RANGES 16
 
 enum HTTP_METHOD {
     GET, POST, PUT, DELETE, CONNECT, PATCH, OPTIONS, TRACE, HEAD
 };
 
+// indexes into HTTP_STATUS_ALL; errors start with BAD_REQUEST
 enum HTTP_STATUS {
     OK = 0,
-    BAD_REQUEST = 2,
-    FORBIDDDEN = 4,
-    NOT_FOUND = 6,
-    INTERNAL_ERROR = 8,
-    NOT_IMPLEMENTED = 10,
-    HTTP_VER = 12
+    PARTIAL_CONTENT = 2,
+    NOT_MODIFIED = 4,
+    BAD_REQUEST = 6,
+    FORBIDDDEN = 8,
+    NOT_FOUND = 10,
+    RANGE_NOT_SATISFIABLE = 12,
+    INTERNAL_ERROR = 14,
+    NOT_IMPLEMENTED = 16,
+    HTTP_VER = 18
 };
 
 enum HTTP_VERSION { V10, V11 };
 
+// bit flags, also indexes into ENCODING_SUFFIX
+enum content_encoding { ENC_IDENTITY = 0, ENC_GZIP = 1, ENC_BR = 2 };
+
 struct HTTP_REQ
 {
     enum HTTP_METHOD method;
-    char uri[URI_SIZE];
+    const char* uri;    // NUL-terminated in the receive buffer
+    const char* query;  // what follows '?' in the URI or NULL
     enum HTTP_VERSION version;
     enum HTTP_STATUS status;
+    int keep_alive;
+    const struct http_parser* parser;
+    off_t resource_size; // for Content-Range of 416 responses
 };
 
-// network i/o
-int sendall(int sfd, const char* data, size_t* dsize);
+struct out_queue;
 
-int isstrin(const char* str, const char * const set[], size_t latest_el);
+// turns the URI into a path relative to the document root without ".",
+// ".." and empty segments; returns -1 if it leads above the root or does
+// not fit
+int
+normalize_path(const char* uri, char* buf, size_t size);
 
-size_t
-content_type(const char *path);
+// opens or stats a normalized path; openat2() keeps the resolution of
+// ".." and symlinks beneath the document root. Sets "linked" if the path
+// goes through a symlink (or that is not known)
+int
+open_beneath(const char* path, int* linked);
+
+int
+stat_beneath(const char* path, struct stat* st);
+
+enum file_transfer { TRANSFER_SENDFILE, TRANSFER_SPLICE, TRANSFER_COPY };
+
+// zero-copy transmission of a file region: sendfile, then splice; sends
+// as much as the socket takes and returns the number of bytes, 0 if the
+// file has been truncated or -1. "how" starts at TRANSFER_SENDFILE for a
+// file and keeps the fallback the file needed
+ssize_t send_file(int sfd, int fd, off_t* offset, size_t count,
+                  enum file_transfer* how);
+
+int isslicein(const struct http_slice* str, const char * const set[],
+              size_t latest_el);
+
+// returns a set of content_encoding flags acceptable for the client
+int
+accepted_encodings(const struct HTTP_REQ* http_req);
+
+// Content-Encoding and Vary header lines of a representation
+const char*
+encoding_headers(const char* mimetype, enum content_encoding encoding);
+
+// opens the document root and builds the status lines and error pages in
+// the server process before the workers are started; returns -1 on errors
+int
+handler_init();
 
 size_t
 put_http_header(char* buf, const struct HTTP_REQ* http_req,
-                const char* path);
+                const char* mimetype, off_t content_length, const char* extra);
+
+#define ETAG_SIZE 64
+
+size_t
+format_etag(char* buf, const struct stat* st);
+
+// puts ETag and Last-Modified header lines
+size_t
+put_validators(char* buf, size_t size, const char* etag, time_t mtime);
+
+struct byte_range
+{
+    off_t first;
+    off_t last;
+};
+
+// returns the number of satisfiable ranges, 0 if there are none
+// and -1 if the header is malformed and has to be ignored
+int
+parse_ranges(const char* value, size_t len, off_t size,
+             struct byte_range* ranges);
+
+// evaluates If-None-Match and If-Modified-Since of the request
+int
+is_not_modified(const struct HTTP_REQ* http_req,
+                const char* etag, time_t mtime);
+
+// returns a value of the header "name" of the request (not terminated)
+const char*
+find_http_header(const struct HTTP_REQ* http_req, const char* name,
+                 size_t* len);
+
+// checks whether a comma-separated header value contains the token
+int
+has_http_token(const char* value, size_t len, const char* token);
 
 void
 print_http_req(const struct HTTP_REQ* http_req);
 
 int
-fill_http_req(struct HTTP_REQ* http_req,
-              const char* method, char* uri, char v1, char v2);
-int
-parse_http_req(struct HTTP_REQ* http_req, const char* req);
+parse_http_req(struct HTTP_REQ* http_req, const struct http_parser* p);
 
 void
-do_http_get(int sfd, struct HTTP_REQ* http_req);
+do_http_get(struct out_queue* out, struct HTTP_REQ* http_req);
 
+// answers with the counters of the workers, see --status-uri
 void
-do_http_req(int sfd, struct HTTP_REQ* http_req);
+do_http_status(struct out_queue* out, struct HTTP_REQ* http_req);
 
 void
-error_http(int sfd, const struct HTTP_REQ* http_req);
+do_http_req(struct out_queue* out, struct HTTP_REQ* http_req);
 
 void
-make_response(int sfd, const char* data);
+error_http(struct out_queue* out, struct HTTP_REQ* http_req);
+
+// answers with an error page out of a request context
+void
+error_response(struct out_queue* out, enum HTTP_STATUS status);
+
+// queues the response and stores its status code in code; returns
+// non-zero if the connection should be kept open, which it never is
+// unless persist is non-zero
+int
+make_response(struct out_queue* out, const struct http_parser* p,
+              int persist, int* code);
 
 #endif
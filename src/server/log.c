@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "server/log.h"
+#include "server/stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Bytes of records a worker can hold back, a power of two */
+#define LOG_RING_SIZE (1 << 20)
+/** Room for the longest record: the fields taken from the request are
+ *  truncated to the sizes below (after escaping) */
+#define LOG_RECORD_MAX 4096
+#define LOG_URI_MAX 2048
+#define LOG_TOKEN_MAX 64
+#define LOG_HEADER_MAX 768
+/** How often the flusher looks into the ring on its own */
+#define LOG_FLUSH_MS 200
+
+/** A single-producer single-consumer ring of formatted records: the
+ *  worker only moves l_head and the flusher only moves l_tail, so
+ *  neither ever waits for the other to update them */
+static struct log_ring
+{
+    char* l_buf;
+    unsigned long l_head __attribute__((aligned(64)));
+    unsigned long l_tail __attribute__((aligned(64)));
+    int l_wake __attribute__((aligned(64))); // a futex, set to wake up early
+    int l_stop;
+} g_log;
+
+static int g_fd = -1;
+static pthread_t g_flusher;
+
+/** The time stamp of records, formatted once a second */
+static time_t g_stamp_time;
+static char g_stamp[32];
+
+int
+access_log_open(const char* path)
+{
+    if(-1 == (g_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644)))
+    {
+        perror("[log] open");
+        return -1;
+    }
+    // the time zone can not be loaded after chroot
+    tzset();
+    return 0;
+}
+
+static void
+wake_flusher()
+{
+    if(0 == __atomic_exchange_n(&g_log.l_wake, 1, __ATOMIC_ACQ_REL))
+    {
+        syscall(SYS_futex, &g_log.l_wake, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+    }
+}
+
+/** Writes out everything the worker has published so far */
+static void
+flush_ring()
+{
+    unsigned long head = __atomic_load_n(&g_log.l_head, __ATOMIC_ACQUIRE);
+    unsigned long tail = g_log.l_tail;
+    size_t from;
+    size_t len;
+    struct iovec iov[2];
+    ssize_t n;
+    int iovcnt;
+
+    while(tail != head)
+    {
+        from = tail & (LOG_RING_SIZE - 1);
+        len = head - tail;
+        iov[0].iov_base = g_log.l_buf + from;
+        if(from + len > LOG_RING_SIZE)
+        {
+            iov[0].iov_len = LOG_RING_SIZE - from;
+            iov[1].iov_base = g_log.l_buf;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        else
+        {
+            iov[0].iov_len = len;
+            iovcnt = 1;
+        }
+
+        if(-1 == (n = writev(g_fd, iov, iovcnt)))
+        {
+            if(EINTR == errno)
+                continue;
+            perror("[log] writev");
+            n = len; // the records are lost
+        }
+        tail += n;
+        __atomic_store_n(&g_log.l_tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void*
+flusher_routine(void* arg)
+{
+    struct timespec ts = {0, LOG_FLUSH_MS * 1000000L};
+    int stop;
+
+    (void) arg;
+    do
+    {
+        stop = __atomic_load_n(&g_log.l_stop, __ATOMIC_ACQUIRE);
+        // a wake-up which comes during the flush cuts the next sleep short
+        __atomic_store_n(&g_log.l_wake, 0, __ATOMIC_RELEASE);
+        flush_ring();
+        if(!stop)
+        {
+            syscall(SYS_futex, &g_log.l_wake, FUTEX_WAIT_PRIVATE, 0, &ts,
+                    NULL, 0);
+        }
+    } while(!stop);
+    return NULL;
+}
+
+int
+access_log_start()
+{
+    sigset_t all;
+    sigset_t old;
+    int rv;
+
+    if(-1 == g_fd)
+        return 0;
+    if(NULL == (g_log.l_buf = malloc(LOG_RING_SIZE)))
+    {
+        perror("[log] malloc");
+        return -1;
+    }
+
+    // signals are for the worker's own thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rv = pthread_create(&g_flusher, NULL, flusher_routine, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(0 != rv)
+    {
+        fprintf(stderr, "[log] pthread_create: %s\n", strerror(rv));
+        free(g_log.l_buf);
+        g_log.l_buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+access_log_stop()
+{
+    if(NULL == g_log.l_buf)
+        return;
+    __atomic_store_n(&g_log.l_stop, 1, __ATOMIC_RELEASE);
+    wake_flusher();
+    pthread_join(g_flusher, NULL);
+    free(g_log.l_buf);
+    g_log.l_buf = NULL;
+}
+
+/** Copies a piece of a request, escaping what could forge a record */
+static size_t
+put_escaped(char* buf, size_t size, const char* s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    size_t i;
+    unsigned char ch;
+
+    for(i = 0; i < len && n + 4 < size; ++i)
+    {
+        ch = s[i];
+        if('\0' == ch)
+        {
+            // where the handler has cut the query off the URI
+            buf[n++] = '?';
+        }
+        else if(ch < 0x20 || ch >= 0x7f || '"' == ch || '\\' == ch)
+        {
+            buf[n++] = '\\';
+            buf[n++] = 'x';
+            buf[n++] = hex[ch >> 4];
+            buf[n++] = hex[ch & 0xf];
+        }
+        else
+        {
+            buf[n++] = ch;
+        }
+    }
+    return n;
+}
+
+static size_t
+put_header(char* buf, const struct http_parser* p, const char* name)
+{
+    const struct http_slice* v = (NULL != p) ? http_parser_header(p, name)
+        : NULL;
+    size_t n = 0;
+
+    buf[n++] = ' ';
+    buf[n++] = '"';
+    if(NULL == v || 0 == v->len)
+        buf[n++] = '-';
+    else
+        n += put_escaped(buf + n, LOG_HEADER_MAX, v->p, v->len);
+    buf[n++] = '"';
+    return n;
+}
+
+static size_t
+format_record(char* buf, const char* peer, const struct http_parser* p,
+              int status, size_t bytes)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    size_t n;
+
+    if(now != g_stamp_time)
+    {
+        g_stamp_time = now;
+        localtime_r(&now, &tm);
+        strftime(g_stamp, sizeof(g_stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    }
+
+    // a peer address and the time stamp take less than 128 bytes
+    n = sprintf(buf, "%s - - [%s] \"", peer, g_stamp);
+    if(NULL != p && 0 != p->method.len)
+    {
+        n += put_escaped(buf + n, LOG_TOKEN_MAX, p->method.p, p->method.len);
+        buf[n++] = ' ';
+        n += put_escaped(buf + n, LOG_URI_MAX, p->uri.p, p->uri.len);
+        buf[n++] = ' ';
+        n += put_escaped(buf + n, LOG_TOKEN_MAX, p->version.p,
+                p->version.len);
+    }
+    else
+    {
+        buf[n++] = '-';
+    }
+    n += sprintf(buf + n, "\" %d %zu", status, bytes);
+
+    if(g_conf.log_combined)
+    {
+        n += put_header(buf + n, p, "Referer");
+        n += put_header(buf + n, p, "User-Agent");
+    }
+    buf[n++] = '\n';
+    return n;
+}
+
+void
+access_log(const char* peer, const struct http_parser* p, int status,
+           size_t bytes)
+{
+    char rec[LOG_RECORD_MAX];
+    unsigned long head = g_log.l_head;
+    size_t len;
+    size_t at;
+    size_t part;
+    struct timespec pause = {0, 1000000};
+
+    if(NULL == g_log.l_buf)
+        return;
+    len = format_record(rec, peer, p, status, bytes);
+
+    while(LOG_RING_SIZE - (head - __atomic_load_n(&g_log.l_tail,
+                    __ATOMIC_ACQUIRE)) < len)
+    {
+        if(!g_conf.log_block)
+        {
+            stats_log_dropped();
+            return;
+        }
+        wake_flusher();
+        nanosleep(&pause, NULL);
+    }
+
+    at = head & (LOG_RING_SIZE - 1);
+    part = (at + len > LOG_RING_SIZE) ? LOG_RING_SIZE - at : len;
+    memcpy(g_log.l_buf + at, rec, part);
+    memcpy(g_log.l_buf, rec + part, len - part);
+    __atomic_store_n(&g_log.l_head, head + len, __ATOMIC_RELEASE);
+
+    // do not let the flusher sleep while the ring fills up
+    if(head + len - __atomic_load_n(&g_log.l_tail, __ATOMIC_RELAXED)
+            > LOG_RING_SIZE / 2)
+        wake_flusher();
+}
@@ -0,0 +1,39 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "config/conf.h"
+#include "server/parser.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** Config for the whole program */
+extern struct conf g_conf;
+
+/** Chatter about single connections and requests, see --debug-log */
+#define debug_printf(...) \
+    do { if(g_conf.debug_on) printf(__VA_ARGS__); } while(0)
+
+/** The access log. The server process opens the file before it chroots;
+ *  every worker formats records into a ring of its own, and a flusher
+ *  thread of the worker writes them out in large batches. */
+
+// returns -1 if the file can not be opened
+int
+access_log_open(const char* path);
+
+// starts the flusher of the calling worker
+int
+access_log_start();
+
+// writes out what is left in the ring and stops the flusher
+void
+access_log_stop();
+
+// p is NULL if the request could not be parsed; bytes is the size of
+// the whole response
+void
+access_log(const char* peer, const struct http_parser* p, int status,
+           size_t bytes);
+
+#endif
@@ -0,0 +1,202 @@
+#include "server/mime.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIME_MIN_SLOTS 64
+#define MIME_LINE_MAX 1024
+
+/** Used if no mime.types file is given or it can not be read */
+static const char * const BUILTIN_TYPES[] = {
+    "html", "text/html",
+    "htm", "text/html",
+    "css", "text/css",
+    "js", "application/javascript",
+    "json", "application/json",
+    "gif", "image/gif",
+    "png", "image/png",
+    "jpg", "image/jpeg",
+    "jpeg", "image/jpeg",
+    "xml", "application/xml",
+    "svg", "image/svg+xml",
+    "txt", "text/plain"
+};
+
+struct mime_slot
+{
+    char m_ext[MIME_EXT_MAX];   // lower case, empty if the slot is free
+    const char* m_type;
+};
+
+/** An open addressing table of extensions, kept at most half full */
+static struct mime_table
+{
+    struct mime_slot* slots;
+    size_t nslots;      // a power of two
+    size_t count;
+} g_mime;
+
+static unsigned int
+hash_ext(const char* ext)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+
+    while('\0' != *ext)
+    {
+        h ^= (unsigned char) *ext++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct mime_slot*
+find_slot(struct mime_slot* slots, size_t nslots, const char* ext)
+{
+    size_t i = hash_ext(ext) & (nslots - 1);
+
+    while('\0' != slots[i].m_ext[0] && 0 != strcmp(slots[i].m_ext, ext))
+        i = (i + 1) & (nslots - 1);
+    return &slots[i];
+}
+
+static int
+grow_table()
+{
+    size_t nslots = g_mime.nslots ? 2 * g_mime.nslots : MIME_MIN_SLOTS;
+    struct mime_slot* slots = calloc(nslots, sizeof(*slots));
+    size_t i;
+
+    if(NULL == slots)
+    {
+        perror("[mime] calloc");
+        return -1;
+    }
+    for(i = 0; i < g_mime.nslots; ++i)
+    {
+        if('\0' != g_mime.slots[i].m_ext[0])
+            *find_slot(slots, nslots, g_mime.slots[i].m_ext)
+                = g_mime.slots[i];
+    }
+    free(g_mime.slots);
+    g_mime.slots = slots;
+    g_mime.nslots = nslots;
+    return 0;
+}
+
+/** Copies the extension in lower case; returns 0 if it does not fit */
+static int
+lower_ext(char* buf, const char* ext, size_t len)
+{
+    size_t i;
+
+    if(0 == len || MIME_EXT_MAX <= len)
+        return 0;
+    for(i = 0; i < len; ++i)
+        buf[i] = tolower((unsigned char) ext[i]);
+    buf[len] = '\0';
+    return 1;
+}
+
+static int
+add_type(const char* ext, size_t len, const char* type)
+{
+    char key[MIME_EXT_MAX];
+    struct mime_slot* slot;
+
+    if(!lower_ext(key, ext, len))
+        return 0; // nobody names files like that
+    if(2 * (g_mime.count + 1) > g_mime.nslots && -1 == grow_table())
+        return -1;
+    slot = find_slot(g_mime.slots, g_mime.nslots, key);
+    if('\0' == slot->m_ext[0])
+    {
+        strcpy(slot->m_ext, key);
+        ++g_mime.count;
+    }
+    slot->m_type = type;
+    return 0;
+}
+
+/** Adds the extensions of a "type ext ext..." line */
+static int
+parse_line(char* line)
+{
+    const char* sep = " \t\r\n";
+    char* save;
+    char* type;
+    char* ext;
+
+    if(NULL == (type = strtok_r(line, sep, &save)) || '#' == *type)
+        return 0;
+    // the types of the file live as long as the process
+    if(NULL == (type = strdup(type)))
+    {
+        perror("[mime] strdup");
+        return -1;
+    }
+    while(NULL != (ext = strtok_r(NULL, sep, &save)) && '#' != *ext)
+    {
+        if(-1 == add_type(ext, strlen(ext), type))
+            return -1;
+    }
+    return 0;
+}
+
+int
+mime_load(const char* path)
+{
+    char line[MIME_LINE_MAX];
+    size_t i;
+    FILE* f;
+    int rv = 0;
+
+    for(i = 0; i < sizeof(BUILTIN_TYPES) / sizeof(*BUILTIN_TYPES); i += 2)
+    {
+        if(-1 == add_type(BUILTIN_TYPES[i], strlen(BUILTIN_TYPES[i]),
+                    BUILTIN_TYPES[i + 1]))
+            return -1;
+    }
+    if(NULL == path)
+        return 0;
+
+    if(NULL == (f = fopen(path, "r")))
+    {
+        fprintf(stderr, "[mime] Could not open \"%s\": %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    while(0 == rv && NULL != fgets(line, sizeof(line), f))
+    {
+        rv = parse_line(line);
+    }
+    fclose(f);
+    return rv;
+}
+
+const char*
+mime_type(const char* path)
+{
+    const char* base = strrchr(path, '/');
+    const char* dot = strrchr((NULL != base) ? base : path, '.');
+    char key[MIME_EXT_MAX];
+    const struct mime_slot* slot;
+
+    if(NULL == dot || 0 == g_mime.nslots
+            || !lower_ext(key, dot + 1, strlen(dot + 1)))
+        return MIME_DEFAULT;
+    slot = find_slot(g_mime.slots, g_mime.nslots, key);
+    return ('\0' != slot->m_ext[0]) ? slot->m_type : MIME_DEFAULT;
+}
+
+int
+mime_compressible(const char* mimetype)
+{
+    return 0 == strncmp(mimetype, "text/", 5)
+        || 0 == strcmp(mimetype, "application/javascript")
+        || 0 == strcmp(mimetype, "application/json")
+        || 0 == strcmp(mimetype, "application/xml")
+        || 0 == strcmp(mimetype, "image/svg+xml");
+}
@@ -0,0 +1,24 @@
+#ifndef MIME_H
+#define MIME_H
+
+#define MIME_DEFAULT "application/octet-stream"
+
+/** Longest extension the table keeps, the terminating NUL included */
+#define MIME_EXT_MAX 16
+
+// fills the table with the built-in types and adds the ones of a
+// mime.types file ("type ext..." lines) unless path is NULL; called before
+// chroot. Returns -1 if the file can not be read, the built-in types are
+// there anyway
+int
+mime_load(const char* path);
+
+// the type of the extension of the last segment of the path
+const char*
+mime_type(const char* path);
+
+// whether files of the type are worth compressing
+int
+mime_compressible(const char* mimetype);
+
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include "server/output.h"
+#include "server/handler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/** Small pieces of a response are gathered into chunks of this size */
+#define OUT_CHUNK_SIZE 512
+
+/** Reasons to keep the socket corked, it is uncorked when none is left */
+#define CORK_FILE 1     // a file region is followed by more data
+#define CORK_BATCH 2    // the owner sends several responses in a row
+
+enum chunk_kind { CHUNK_MEM, CHUNK_REF, CHUNK_FILE, CHUNK_HOLD };
+
+struct out_chunk
+{
+    struct out_chunk* next;
+    enum chunk_kind kind;
+    const char* data;   // the unsent part of MEM and REF chunks
+    size_t len;         // bytes left to send
+    size_t room;        // free space after the data of a MEM chunk
+    int fd;
+    int owned;          // the descriptor is closed with the chunk
+    off_t offset;
+    enum file_transfer how; // of a FILE chunk
+    void (*release)(void*); // of a HOLD chunk, with "arg"
+    void* arg;
+    char buf[];         // the data of a MEM chunk
+};
+
+static struct out_chunk*
+new_chunk(struct out_queue* q, enum chunk_kind kind, size_t size)
+{
+    struct out_chunk* ch = malloc(sizeof(*ch) + size);
+
+    if(NULL == ch)
+        return NULL;
+    memset(ch, 0, sizeof(*ch));
+    ch->kind = kind;
+    ch->data = ch->buf;
+    ch->room = size;
+    ch->fd = -1;
+    if(NULL != q->o_tail)
+        q->o_tail->next = ch;
+    else
+        q->o_head = ch;
+    q->o_tail = ch;
+    return ch;
+}
+
+static void
+free_chunk(struct out_chunk* ch)
+{
+    if(ch->owned)
+        close(ch->fd);
+    if(CHUNK_HOLD == ch->kind)
+        ch->release(ch->arg);
+    free(ch);
+}
+
+/** A chunk which is not sent, ignored when the caller looks for more */
+static int
+is_data(const struct out_chunk* ch)
+{
+    for(; NULL != ch; ch = ch->next)
+    {
+        if(CHUNK_HOLD != ch->kind)
+            return 1;
+    }
+    return 0;
+}
+
+void
+out_init(struct out_queue* q)
+{
+    q->o_head = q->o_tail = NULL;
+    q->o_sent = 0;
+    q->o_queued = 0;
+    q->o_corked = 0;
+}
+
+int
+out_append(struct out_queue* q, const void* data, size_t len)
+{
+    struct out_chunk* ch = q->o_tail;
+
+    if(NULL == ch || CHUNK_MEM != ch->kind || ch->room < len)
+    {
+        ch = new_chunk(q, CHUNK_MEM,
+                (len > OUT_CHUNK_SIZE) ? len : OUT_CHUNK_SIZE);
+        if(NULL == ch)
+            return -1;
+    }
+    q->o_queued += len;
+    memcpy((char*) ch->data + ch->len, data, len);
+    ch->len += len;
+    ch->room -= len;
+    return 0;
+}
+
+int
+out_ref(struct out_queue* q, const void* data, size_t len)
+{
+    struct out_chunk* ch;
+
+    if(0 == len)
+        return 0;
+    if(NULL == (ch = new_chunk(q, CHUNK_REF, 0)))
+        return -1;
+    q->o_queued += len;
+    ch->data = data;
+    ch->len = len;
+    return 0;
+}
+
+int
+out_file(struct out_queue* q, int fd, off_t offset, off_t count)
+{
+    struct out_chunk* ch;
+
+    if(0 == count)
+        return 0;
+    if(NULL == (ch = new_chunk(q, CHUNK_FILE, 0)))
+        return -1;
+    q->o_queued += count;
+    ch->fd = fd;
+    ch->offset = offset;
+    ch->len = count;
+    return 0;
+}
+
+int
+out_hold(struct out_queue* q, void (*release)(void*), void* arg)
+{
+    struct out_chunk* ch;
+
+    if(!is_data(q->o_head))
+    {
+        release(arg); // nothing queued could refer to it
+        return 0;
+    }
+    if(NULL == (ch = new_chunk(q, CHUNK_HOLD, 0)))
+        return -1;
+    ch->release = release;
+    ch->arg = arg;
+    return 0;
+}
+
+int
+out_pin(struct out_queue* q)
+{
+    struct out_chunk** pp;
+    struct out_chunk* ch;
+    struct out_chunk* copy;
+
+    for(pp = &q->o_head; NULL != (ch = *pp); pp = &(*pp)->next)
+    {
+        if(CHUNK_FILE == ch->kind && !ch->owned)
+        {
+            if(-1 == (ch->fd = fcntl(ch->fd, F_DUPFD_CLOEXEC, 0)))
+                return -1;
+            ch->owned = 1;
+        }
+        else if(CHUNK_REF == ch->kind)
+        {
+            if(NULL == (copy = malloc(sizeof(*copy) + ch->len)))
+                return -1;
+            *copy = *ch;
+            copy->kind = CHUNK_MEM;
+            copy->data = memcpy(copy->buf, ch->data, ch->len);
+            if(q->o_tail == ch)
+                q->o_tail = copy;
+            *pp = copy;
+            free(ch);
+        }
+    }
+    return 0;
+}
+
+static void
+pop_chunk(struct out_queue* q)
+{
+    struct out_chunk* ch = q->o_head;
+
+    if(NULL == (q->o_head = ch->next))
+        q->o_tail = NULL;
+    free_chunk(ch);
+}
+
+/** Releases what the sent data has referred to */
+static void
+pop_holds(struct out_queue* q)
+{
+    while(NULL != q->o_head && CHUNK_HOLD == q->o_head->kind)
+        pop_chunk(q);
+}
+
+int
+out_peek_iov(const struct out_queue* q, struct iovec* iov, int max,
+             int* more)
+{
+    struct out_chunk* ch;
+    int iovcnt = 0;
+
+    for(ch = q->o_head; NULL != ch && CHUNK_FILE != ch->kind
+            && iovcnt < max; ch = ch->next)
+    {
+        if(CHUNK_HOLD == ch->kind)
+            continue;
+        iov[iovcnt].iov_base = (void*) ch->data;
+        iov[iovcnt++].iov_len = ch->len;
+    }
+    *more = is_data(ch);
+    return iovcnt;
+}
+
+int
+out_peek_file(const struct out_queue* q, int* fd, off_t* offset,
+              size_t* len, int* more)
+{
+    struct out_chunk* ch = q->o_head;
+
+    if(NULL == ch || CHUNK_FILE != ch->kind)
+        return -1;
+    *fd = ch->fd;
+    *offset = ch->offset;
+    *len = ch->len;
+    *more = is_data(ch->next);
+    return 0;
+}
+
+void
+out_consume(struct out_queue* q, size_t n)
+{
+    struct out_chunk* ch;
+
+    q->o_sent += n;
+    while(0 < n && NULL != (ch = q->o_head))
+    {
+        if(n < ch->len)
+        {
+            if(CHUNK_FILE == ch->kind)
+                ch->offset += n;
+            else
+                ch->data += n;
+            ch->len -= n;
+            break;
+        }
+        n -= ch->len;
+        pop_chunk(q);
+    }
+    pop_holds(q);
+}
+
+/** Sends a run of in-memory chunks with one call, "len" is set to
+ *  their total size */
+static ssize_t
+flush_memory(struct out_queue* q, int sfd, size_t* len)
+{
+    struct iovec iov[OUT_IOV_MAX];
+    struct msghdr msg;
+    ssize_t n;
+    int more;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = out_peek_iov(q, iov, OUT_IOV_MAX, &more);
+    *len = 0;
+    for(i = 0; i < (int) msg.msg_iovlen; ++i)
+        *len += iov[i].iov_len;
+
+    // a file follows, do not send the header in a packet of its own
+    n = sendmsg(sfd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if(0 < n)
+        out_consume(q, n);
+    return n;
+}
+
+static void
+set_cork(struct out_queue* q, int sfd, int corked)
+{
+    int on = (0 != corked);
+
+    // a failure costs no more than a partial segment
+    if(on != (0 != q->o_corked))
+        setsockopt(sfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    q->o_corked = corked;
+}
+
+void
+out_cork(struct out_queue* q, int sfd)
+{
+    set_cork(q, sfd, q->o_corked | CORK_BATCH);
+}
+
+void
+out_uncork(struct out_queue* q, int sfd)
+{
+    set_cork(q, sfd, q->o_corked & ~CORK_BATCH);
+}
+
+int
+out_flush(struct out_queue* q, int sfd)
+{
+    struct out_chunk* ch;
+    size_t len;
+    ssize_t n;
+    off_t offset;
+
+    while(NULL != (ch = q->o_head))
+    {
+        len = ch->len;
+        if(CHUNK_FILE == ch->kind)
+        {
+            // sendfile() pushes the tail of the region out on its own
+            if(is_data(ch->next))
+                set_cork(q, sfd, q->o_corked | CORK_FILE);
+            offset = ch->offset;
+            n = send_file(sfd, ch->fd, &offset, len, &ch->how);
+            if(0 == n)
+            {
+                errno = EIO; // the file has been truncated
+                return -1;
+            }
+            if(0 < n)
+                out_consume(q, n);
+        }
+        else
+        {
+            n = flush_memory(q, sfd, &len);
+        }
+
+        if(-1 == n)
+        {
+            if(EINTR == errno)
+                continue;
+            return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+        }
+        if((size_t) n < len)
+        {
+            // the socket buffer is full, epoll tells when it is not
+            return 0;
+        }
+    }
+    set_cork(q, sfd, q->o_corked & ~CORK_FILE);
+    return 1;
+}
+
+int
+out_empty(const struct out_queue* q)
+{
+    return NULL == q->o_head;
+}
+
+void
+out_clear(struct out_queue* q)
+{
+    while(NULL != q->o_head)
+        pop_chunk(q);
+}
@@ -0,0 +1,88 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Response data which has not been sent to the client yet. A handler
+ *  queues a whole response and the worker writes it out as fast as the
+ *  non-blocking socket accepts it. Data and files can be queued by
+ *  reference (e.g. from the file cache); such chunks are only valid until
+ *  the next response is made, so out_pin() has to be called if the queue
+ *  can not be drained at once. */
+struct out_chunk;
+
+/** At most that many chunks are sent with one sendmsg() */
+#define OUT_IOV_MAX 16
+
+struct out_queue
+{
+    struct out_chunk* o_head;
+    struct out_chunk* o_tail;
+    size_t o_sent;      // bytes consumed, for the owner to collect
+    size_t o_queued;    // bytes ever queued
+    int o_corked;       // why the socket holds back partial segments
+};
+
+void
+out_init(struct out_queue* q);
+
+// copies the data into the queue; returns -1 if out of memory
+int
+out_append(struct out_queue* q, const void* data, size_t len);
+
+// queues the data by reference
+int
+out_ref(struct out_queue* q, const void* data, size_t len);
+
+// queues a region of the file by reference to its descriptor
+int
+out_file(struct out_queue* q, int fd, off_t offset, off_t count);
+
+// calls release(arg) once everything queued so far has been sent or the
+// queue is cleared, so data queued by reference can outlive the caller
+int
+out_hold(struct out_queue* q, void (*release)(void*), void* arg);
+
+// makes the queue independent of referenced data and descriptors
+int
+out_pin(struct out_queue* q);
+
+// returns 1 if everything has been sent, 0 if the socket is full
+// and -1 on an error; a file region followed by more data is sent with
+// the socket corked, so the parts of a response share segments
+int
+out_flush(struct out_queue* q, int sfd);
+
+// holds back partial segments of the socket (TCP_CORK) until
+// out_uncork(), e.g. while pipelined responses are sent back to back
+void
+out_cork(struct out_queue* q, int sfd);
+
+void
+out_uncork(struct out_queue* q, int sfd);
+
+// for callers which send the data by themselves: describes up to max
+// in-memory chunks at the head of the queue and sets "more" if anything
+// follows them; returns 0 if the queue is empty or starts with a file
+int
+out_peek_iov(const struct out_queue* q, struct iovec* iov, int max,
+             int* more);
+
+// describes the file region at the head of the queue, -1 if there is none
+int
+out_peek_file(const struct out_queue* q, int* fd, off_t* offset,
+              size_t* len, int* more);
+
+// drops n bytes which have been sent from the head of the queue
+void
+out_consume(struct out_queue* q, size_t n);
+
+int
+out_empty(const struct out_queue* q);
+
+void
+out_clear(struct out_queue* q);
+
+#endif
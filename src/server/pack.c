@@ -0,0 +1,165 @@
+#include "server/pack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* g_base;
+static const struct pack_header* g_pack;
+static int g_fd = -1;
+
+uint32_t
+pack_hash(const char* path, size_t len, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u); // FNV-1a
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    // FNV alone spreads the low bits of similar paths poorly
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/** Checks that a NUL-terminated string lies within the pack */
+static int
+is_string(uint64_t off, uint64_t size)
+{
+    return off < size && NULL != memchr(g_base + off, '\0', size - off);
+}
+
+static int
+is_region(uint64_t off, uint64_t len, uint64_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+/** Every offset is checked once, so lookups can trust them */
+static int
+is_valid(uint64_t size)
+{
+    const struct pack_header* h = (const struct pack_header*) g_base;
+    const struct pack_entry* entries;
+    const struct pack_variant* v;
+    const uint32_t* slots;
+    uint32_t i;
+    int enc;
+
+    if(size < sizeof(*h) || 0 != memcmp(h->p_magic, PACK_MAGIC, 8)
+            || h->p_size != size || 0 == h->p_nbuckets
+            || !is_region(h->p_buckets, h->p_nbuckets * 4ULL, size)
+            || !is_region(h->p_slots, h->p_count * 4ULL, size)
+            || !is_region(h->p_entries,
+                h->p_count * (uint64_t) sizeof(*entries), size)
+            || 0 != h->p_entries % __alignof__(struct pack_entry)
+            || 0 != (h->p_slots | h->p_buckets) % 4)
+        return 0;
+
+    slots = (const uint32_t*) (g_base + h->p_slots);
+    entries = (const struct pack_entry*) (g_base + h->p_entries);
+    for(i = 0; i < h->p_count; ++i)
+    {
+        if(slots[i] >= h->p_count || !is_string(entries[i].e_path, size)
+                || strlen(g_base + entries[i].e_path)
+                    != entries[i].e_path_len
+                || !is_string(entries[i].e_mimetype, size))
+            return 0;
+        for(enc = 0; enc < PACK_NVARIANTS; ++enc)
+        {
+            v = &entries[i].e_v[enc];
+            if(0 != enc && 0 == (entries[i].e_variants & enc))
+                continue;
+            if(!is_region(v->v_body, v->v_size, size)
+                    || !is_region(v->v_header, v->v_header_len, size)
+                    || v->v_validators_len > v->v_header_len
+                    || !is_string(v->v_etag, size))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int
+pack_open(const char* path)
+{
+    struct stat st;
+    void* map;
+
+    if(-1 == (g_fd = open(path, O_RDONLY | O_CLOEXEC)))
+    {
+        perror("[pack] open");
+        return -1;
+    }
+    if(-1 == fstat(g_fd, &st))
+    {
+        perror("[pack] fstat");
+        goto fail;
+    }
+    map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_SHARED,
+            g_fd, 0);
+    if(MAP_FAILED == map)
+    {
+        perror("[pack] mmap");
+        goto fail;
+    }
+    g_base = map;
+    if(!is_valid(st.st_size))
+    {
+        fprintf(stderr, "[pack] \"%s\" is not a pack or is damaged\n", path);
+        munmap(map, st.st_size ? st.st_size : 1);
+        g_base = NULL;
+        goto fail;
+    }
+    g_pack = (const struct pack_header*) g_base;
+    return 0;
+
+fail:
+    close(g_fd);
+    g_fd = -1;
+    return -1;
+}
+
+const struct pack_entry*
+pack_find(const char* path)
+{
+    const uint32_t* buckets;
+    const uint32_t* slots;
+    const struct pack_entry* e;
+    size_t len;
+    uint32_t d;
+
+    if(NULL == g_pack || 0 == g_pack->p_count)
+        return NULL;
+    len = strlen(path);
+    buckets = (const uint32_t*) (g_base + g_pack->p_buckets);
+    slots = (const uint32_t*) (g_base + g_pack->p_slots);
+    d = buckets[pack_hash(path, len, 0) % g_pack->p_nbuckets];
+    e = (const struct pack_entry*) (g_base + g_pack->p_entries)
+        + slots[pack_hash(path, len, d) % g_pack->p_count];
+    // a path which is not in the pack lands on some other one
+    if(e->e_path_len != len || 0 != memcmp(g_base + e->e_path, path, len))
+        return NULL;
+    return e;
+}
+
+const char*
+pack_base()
+{
+    return g_base;
+}
+
+int
+pack_fd()
+{
+    return g_fd;
+}
@@ -0,0 +1,69 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A site packed by the sitepack tool into a single file: an index of
+ *  normalized paths (as normalize_path() makes them) with a perfect hash,
+ *  the prebuilt header of every representation and the bodies. Numbers
+ *  are in the byte order of the machine which has built it. */
+#define PACK_MAGIC "WSPACK\0\1"
+
+/** Representations of a file by content_encoding: identity, gzip, br */
+#define PACK_NVARIANTS 3
+
+struct pack_header
+{
+    char p_magic[8];
+    uint64_t p_size;        // of the whole file
+    uint32_t p_count;       // files
+    uint32_t p_nbuckets;    // of the displacement table
+    uint64_t p_buckets;     // offset of a uint32_t displacement per bucket
+    uint64_t p_slots;       // offset of a uint32_t entry index per file
+    uint64_t p_entries;     // offset of the struct pack_entry array
+    int64_t p_built;
+};
+
+struct pack_variant
+{
+    uint64_t v_body;        // offset of the body
+    uint64_t v_size;
+    uint32_t v_header;      // offset of the header lines, the same as the
+    uint32_t v_header_len;  // file cache builds: validators, Accept-Ranges,
+    uint32_t v_validators_len; // Content-Encoding/Vary, type and length
+    uint32_t v_etag;        // offset of the ETag value, NUL-terminated
+};
+
+struct pack_entry
+{
+    uint32_t e_path;        // offset of the path, NUL-terminated
+    uint32_t e_path_len;
+    uint32_t e_mimetype;    // offset, NUL-terminated
+    uint32_t e_variants;    // content_encoding flags of compressed variants
+    int64_t e_mtime;
+    struct pack_variant e_v[PACK_NVARIANTS];
+};
+
+// the hash of the index; seed 0 picks the bucket of a path, and the
+// displacement of the bucket its slot
+uint32_t
+pack_hash(const char* path, size_t len, uint32_t seed);
+
+// maps the pack read-only in the server process before chroot, so the
+// workers share it; returns -1 if it can not be read or is damaged
+int
+pack_open(const char* path);
+
+// NULL if the path is not in the pack (or there is no pack)
+const struct pack_entry*
+pack_find(const char* path);
+
+// the pack, to resolve offsets, and its descriptor for sendfile()
+const char*
+pack_base();
+
+int
+pack_fd();
+
+#endif
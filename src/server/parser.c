@@ -0,0 +1,189 @@
+#include "server/parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+enum parser_state
+{
+    S_START,        // skipping empty lines before the request line
+    S_METHOD,
+    S_URI_START,
+    S_URI,
+    S_VERSION,
+    S_REQ_LINE_LF,
+    S_HEADER_START,
+    S_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF
+};
+
+/** RFC 7230 tchar */
+static int
+is_token_char(unsigned char c)
+{
+    if(('a' <= c && 'z' >= c) || ('A' <= c && 'Z' >= c)
+            || ('0' <= c && '9' >= c))
+        return 1;
+    return NULL != strchr("!#$%&'*+-.^_`|~", c) && '\0' != c;
+}
+
+void
+http_parser_reset(struct http_parser* p)
+{
+    p->state = S_START;
+    p->pos = 0;
+    p->mark = 0;
+    p->nheaders = 0;
+}
+
+enum parse_result
+http_parse(struct http_parser* p, char* buf, size_t len)
+{
+    size_t i;
+    unsigned char c;
+    struct http_header* h;
+
+    for(i = p->pos; i < len; ++i)
+    {
+        c = buf[i];
+        switch(p->state)
+        {
+            case S_START:
+                if('\r' == c || '\n' == c)
+                    break;
+                if(!is_token_char(c))
+                    return PARSE_ERROR;
+                p->mark = i;
+                p->state = S_METHOD;
+                break;
+
+            case S_METHOD:
+                if(' ' == c)
+                {
+                    p->method.p = buf + p->mark;
+                    p->method.len = i - p->mark;
+                    p->state = S_URI_START;
+                }
+                else if(!is_token_char(c))
+                    return PARSE_ERROR;
+                break;
+
+            case S_URI_START:
+                if(c <= ' ' || c >= 0x7f)
+                    return PARSE_ERROR;
+                p->mark = i;
+                p->state = S_URI;
+                break;
+
+            case S_URI:
+                if(' ' == c)
+                {
+                    p->uri.p = buf + p->mark;
+                    p->uri.len = i - p->mark;
+                    p->mark = i + 1;
+                    p->state = S_VERSION;
+                }
+                else if(c < ' ' || c >= 0x7f)
+                    return PARSE_ERROR;
+                break;
+
+            case S_VERSION:
+                if('\r' == c || '\n' == c)
+                {
+                    p->version.p = buf + p->mark;
+                    p->version.len = i - p->mark;
+                    p->state = ('\r' == c) ? S_REQ_LINE_LF : S_HEADER_START;
+                }
+                else if(c <= ' ' || c >= 0x7f)
+                    return PARSE_ERROR;
+                break;
+
+            case S_REQ_LINE_LF:
+            case S_HEADER_LF:
+                if('\n' != c)
+                    return PARSE_ERROR;
+                p->state = S_HEADER_START;
+                break;
+
+            case S_HEADER_START:
+                if('\r' == c)
+                {
+                    p->state = S_END_LF;
+                    break;
+                }
+                if('\n' == c)
+                    goto done;
+                // obsolete line folding is rejected as well
+                if(!is_token_char(c) || MAX_HEADERS == p->nheaders)
+                    return PARSE_ERROR;
+                p->mark = i;
+                p->state = S_NAME;
+                break;
+
+            case S_NAME:
+                if(':' == c)
+                {
+                    h = &p->headers[p->nheaders];
+                    h->name.p = buf + p->mark;
+                    h->name.len = i - p->mark;
+                    p->state = S_VALUE_START;
+                }
+                else if(!is_token_char(c))
+                    return PARSE_ERROR;
+                break;
+
+            case S_VALUE_START:
+                if(' ' == c || '\t' == c)
+                    break;
+                p->mark = p->vend = i;
+                p->state = S_VALUE;
+                // fall through
+            case S_VALUE:
+                if('\r' == c || '\n' == c)
+                {
+                    h = &p->headers[p->nheaders++];
+                    h->value.p = buf + p->mark;
+                    h->value.len = p->vend - p->mark;
+                    p->state = ('\r' == c) ? S_HEADER_LF : S_HEADER_START;
+                }
+                else if(' ' != c && '\t' != c)
+                {
+                    if(c < ' ' || 0x7f == c)
+                        return PARSE_ERROR;
+                    p->vend = i + 1;
+                }
+                break;
+
+            case S_END_LF:
+                if('\n' != c)
+                    return PARSE_ERROR;
+                goto done;
+        }
+    }
+
+    p->pos = len;
+    return PARSE_AGAIN;
+
+done:
+    p->pos = i + 1;
+    // the separator after the URI has already been parsed
+    buf[p->uri.p + p->uri.len - buf] = '\0';
+    return PARSE_DONE;
+}
+
+const struct http_slice*
+http_parser_header(const struct http_parser* p, const char* name)
+{
+    int i;
+    size_t len = strlen(name);
+
+    for(i = 0; i < p->nheaders; ++i)
+    {
+        if(p->headers[i].name.len == len
+                && 0 == strncasecmp(p->headers[i].name.p, name, len))
+            return &p->headers[i].value;
+    }
+    return NULL;
+}
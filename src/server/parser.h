@@ -0,0 +1,51 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+
+#define MAX_HEADERS 32
+
+/** A piece of the receive buffer, not NUL-terminated */
+struct http_slice
+{
+    const char* p;
+    size_t len;
+};
+
+struct http_header
+{
+    struct http_slice name;
+    struct http_slice value;
+};
+
+enum parse_result { PARSE_DONE, PARSE_AGAIN, PARSE_ERROR };
+
+/** A resumable parser of a request line and headers. It never copies
+ *  or allocates: all fields point into the buffer given to http_parse(),
+ *  so the buffer must not move until the request has been answered. */
+struct http_parser
+{
+    int state;
+    size_t pos;         // bytes consumed so far
+    size_t mark;        // the beginning of the current token
+    size_t vend;        // the end of a header value without trailing OWS
+    struct http_slice method;
+    struct http_slice uri;
+    struct http_slice version;
+    struct http_header headers[MAX_HEADERS];
+    int nheaders;
+};
+
+void
+http_parser_reset(struct http_parser* p);
+
+// continues parsing of buf[p->pos, len); on PARSE_DONE p->pos is the size
+// of the request, and the URI is NUL-terminated in place
+enum parse_result
+http_parse(struct http_parser* p, char* buf, size_t len);
+
+// returns a value of the header "name" or NULL
+const struct http_slice*
+http_parser_header(const struct http_parser* p, const char* name);
+
+#endif
@@ -1,4 +1,11 @@
 #include "config/config.h"
+#include "server/handler.h"
+#include "server/log.h"
+#include "server/mime.h"
+#include "server/pack.h"
+#include "server/server.h"
+#include "server/stats.h"
+#include "server/watch.h"
 #include "server/worker.h"
 
 #include <errno.h>
@@ -6,7 +13,8 @@
 #include <grp.h>
 #include <pwd.h>
 #include <netdb.h>
-#include <semaphore.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -16,18 +24,31 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#define BACKLOG_SIZE 4
+/** Whether the kernel passes the connections of a closed SO_REUSEPORT
+ *  socket on to the rest of its group */
+#define MIGRATE_REQ_PATH "/proc/sys/net/ipv4/tcp_migrate_req"
 
 struct perms {
     uid_t p_uid;
     gid_t p_gid;
 };
 
-static sem_t* g_sem;
-
 /** Config for the whole program */
 extern struct conf g_conf;
 
+/** Listening sockets outlive server processes: the manager opens them,
+ *  every generation of the server inherits them, and a reload which
+ *  does not change the address keeps them, so the port is never closed */
+static struct listeners
+{
+    int* l_fds;     // one per worker with reuseport, a single one otherwise
+    int l_count;
+    char* l_host;
+    char* l_port;
+    int l_reuseport;
+    enum io_engine l_engine; // uring workers make the sockets blocking
+} g_listeners;
+
 static volatile sig_atomic_t g_nsig = 0;
 
 static void
@@ -83,6 +104,7 @@ setsigmask()
     sigdelset(&mask, SIGHUP);
     sigdelset(&mask, SIGINT);
     sigdelset(&mask, SIGTERM);
+    sigdelset(&mask, SIGQUIT);
     sigdelset(&mask, SIGCHLD);
     sigprocmask(SIG_SETMASK, &mask, NULL);
 }
@@ -104,15 +126,37 @@ setup_ipc()
     sigaction(SIGCHLD, &sadfl, NULL);
     sigaction(SIGINT, &sadfl, NULL);
     sigaction(SIGTERM, &sadfl, NULL);
+}
 
-    if(SEM_FAILED == (g_sem = sem_open("/webserver.sem", O_RDWR)))
+/** Applies the options an open listening socket can change, so a reload
+ *  changes them without closing the socket. listen() again only sets the
+ *  backlog of a socket which is listening already */
+static int
+tune_listener(int sfd)
+{
+    if(-1 == setsockopt(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                &g_conf.defer_accept_sec, sizeof(g_conf.defer_accept_sec)))
+    {
+        perror("[server] TCP_DEFER_ACCEPT");
+        return -1;
+    }
+    // 0 turns Fast Open off again; net.ipv4.tcp_fastopen has to allow it
+    if(-1 == setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN,
+                &g_conf.fastopen_qlen, sizeof(g_conf.fastopen_qlen)))
     {
-        perror("[server] sem_open");
+        perror("[server] TCP_FASTOPEN");
+        return -1;
     }
+    if(-1 == listen(sfd, g_conf.listen_backlog))
+    {
+        perror("[server] listen");
+        return -1;
+    }
+    return 0;
 }
 
 static int
-prepare_server()
+prepare_server(int reuseport)
 {
     int status;
     char* port = g_conf.port;
@@ -131,7 +175,7 @@ prepare_server()
     if(0 != (status = getaddrinfo(host, port, &hints, &servinfo)))
     {
         fprintf(stderr, "[server] getaddrinfo: %s\n", gai_strerror(status));
-        _exit(EXIT_FAILURE);
+        return -1;
     }
 
     int yes = 1;
@@ -144,7 +188,18 @@ prepare_server()
 
         if(-1 == setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
             perror("[server] setsockopt");
-            _exit(EXIT_FAILURE);
+            close(sfd);
+            freeaddrinfo(servinfo);
+            return -1;
+        }
+        if(reuseport && (-1 == setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT,
+                        &yes, sizeof(yes))
+                    || -1 == fcntl(sfd, F_SETFL, O_NONBLOCK)))
+        {
+            perror("[server] SO_REUSEPORT");
+            close(sfd);
+            freeaddrinfo(servinfo);
+            return -1;
         }
 
         if(0 == bind(sfd, p->ai_addr, p->ai_addrlen))
@@ -155,23 +210,156 @@ prepare_server()
         close(sfd);
     }
 
+    freeaddrinfo(servinfo);
     if(p == NULL)
     {
         perror("[server] Could not bind");
-        _exit(EXIT_FAILURE);
+        return -1;
     }
 
-    freeaddrinfo(servinfo);
-
-    if(-1 == listen(sfd, BACKLOG_SIZE))
+    if(-1 == tune_listener(sfd))
     {
-        perror("[server] listen");
-        _exit(EXIT_FAILURE);
+        close(sfd);
+        return -1;
     }
 
     return sfd;
 }
 
+/** The host is NULL for any address */
+static int
+same_host(const char* a, const char* b)
+{
+    return (NULL == a || NULL == b) ? a == b : 0 == strcmp(a, b);
+}
+
+static int
+listeners_match(const struct listeners* l)
+{
+    return NULL != l->l_fds
+        && same_host(l->l_host, g_conf.host)
+        && 0 == strcmp(l->l_port, g_conf.port)
+        && l->l_reuseport == g_conf.reuse_port
+        && (!l->l_reuseport || (l->l_count == g_conf.nworkers
+                    && l->l_engine == g_conf.engine));
+}
+
+static int
+migrates_requests()
+{
+    FILE* f;
+    int n = 0;
+
+    if(NULL != (f = fopen(MIGRATE_REQ_PATH, "r")))
+    {
+        if(1 != fscanf(f, "%d", &n))
+            n = 0;
+        fclose(f);
+    }
+    return 0 != n;
+}
+
+static void
+free_listeners(struct listeners* l)
+{
+    int i;
+
+    for(i = 0; NULL != l->l_fds && i < l->l_count; ++i)
+    {
+        if(-1 != l->l_fds[i])
+            close(l->l_fds[i]);
+    }
+    free(l->l_fds);
+    free(l->l_host);
+    free(l->l_port);
+    memset(l, 0, sizeof(*l));
+}
+
+int
+open_listeners()
+{
+    int i;
+    struct listeners l;
+
+    if(listeners_match(&g_listeners))
+    {
+        for(i = 0; i < g_listeners.l_count; ++i)
+        {
+            if(-1 == tune_listener(g_listeners.l_fds[i]))
+                return -1;
+        }
+        return 0;
+    }
+
+    memset(&l, 0, sizeof(l));
+    l.l_count = g_conf.reuse_port ? g_conf.nworkers : 1;
+    l.l_reuseport = g_conf.reuse_port;
+    l.l_engine = g_conf.engine;
+    if(NULL == (l.l_fds = malloc(l.l_count * sizeof(*l.l_fds)))
+            || (NULL != g_conf.host
+                && NULL == (l.l_host = strdup(g_conf.host)))
+            || NULL == (l.l_port = strdup(g_conf.port)))
+    {
+        perror("[server] malloc for listening sockets failed");
+        free_listeners(&l);
+        return -1;
+    }
+    for(i = 0; i < l.l_count; ++i)
+        l.l_fds[i] = -1;
+    for(i = 0; i < l.l_count; ++i)
+    {
+        if(-1 == (l.l_fds[i] = prepare_server(l.l_reuseport)))
+        {
+            free_listeners(&l);
+            return -1;
+        }
+    }
+
+    // the old workers close theirs once they have accepted what is queued
+    if(NULL != g_listeners.l_fds && g_listeners.l_reuseport
+            && !migrates_requests())
+    {
+        printf("[server] The SO_REUSEPORT group is replaced, handshakes "
+                "in progress on the old sockets are reset unless "
+                "net.ipv4.tcp_migrate_req is 1\n");
+    }
+    // the generations which use the old ones have copies of their own
+    free_listeners(&g_listeners);
+    g_listeners = l;
+    return 0;
+}
+
+/** Checks the flags set by signal handlers.
+ *  Returns non-zero if the server has to stop. */
+static int
+handle_signals()
+{
+    if(0 != g_nsig)
+    {
+        // the manager starts a new generation which takes over from this one
+        printf("[server] Reload requested\n");
+        g_nsig = 0;
+        kill(getppid(), SIGHUP);
+    }
+
+    if(is_reaping_needed())
+    {
+        printf("[server] Termination requested\n");
+        return 1;
+    }
+    else if(is_draining_needed())
+    {
+        printf("[server] Graceful stop requested\n");
+        return 1;
+    }
+    else if(is_respawn_needed())
+    {
+        printf("[server] Respawn a worker\n");
+        respawn_worker();
+    }
+    return 0;
+}
+
 static int
 run_server(int master)
 {
@@ -184,7 +372,7 @@ run_server(int master)
         slave = accept(master, (struct sockaddr*) &client, &addr_size);
         if(-1 != slave)
         {
-            printf("[server] new client: %d\n", slave);
+            debug_printf("[server] new client: %d\n", slave);
             worker_fd_pass(slave);
             close(slave);
         }
@@ -197,28 +385,39 @@ run_server(int master)
             }
         }
 
-        if(0 != g_nsig)
+        if(0 != handle_signals())
         {
-            if(SEM_FAILED != g_sem)
-            {
-                printf("[server] Reload requested\n");
-                sem_post(g_sem);
-                break;
-            }
-        }
-        else if(is_reaping_needed())
-        {
-            printf("[server] Termination requested\n");
             break;
         }
-        else if(is_respawn_needed())
-        {
-            printf("[server] Respawn a worker\n");
-            respawn_worker();
-        }
     }
 
-    shutdown(master, SHUT_RDWR);
+    // not shut down: the next generation accepts on the same socket
+    close(master);
+    return 0;
+}
+
+/** The workers accept connections by themselves, so the server
+ *  only has to look after them */
+static int
+supervise_workers()
+{
+    sigset_t mask;
+    sigset_t oldmask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    while(0 == handle_signals())
+    {
+        sigsuspend(&oldmask);
+    }
+
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
     return 0;
 }
 
@@ -228,20 +427,76 @@ runservinproc()
     pid_t servpid = fork();
     if(0 == servpid)
     {
+        int i;
         int rv;
+        int listensocket = -1;
+        int lfds[g_conf.nworkers];
         setup_ipc();
         struct perms p = get_perms();
-        int listensocket = prepare_server();
+        for(i = 0; i < g_conf.nworkers; ++i)
+        {
+            lfds[i] = g_conf.reuse_port ? g_listeners.l_fds[i] : -1;
+        }
+        if(0 == g_conf.reuse_port)
+        {
+            listensocket = g_listeners.l_fds[0];
+        }
+        if(-1 == prepare_workers(lfds))
+        {
+            _exit(EXIT_FAILURE);
+        }
+        // /dev/shm is out of reach after chroot
+        if(-1 == stats_create(g_conf.nworkers))
+        {
+            fprintf(stderr, "[server] Statistics are not available\n");
+        }
+        if(g_conf.access_log_on && -1 == access_log_open(g_conf.access_log))
+        {
+            fprintf(stderr, "[server] The access log is disabled\n");
+        }
+        if(-1 == mime_load(g_conf.mime_types_on ? g_conf.mime_types : NULL))
+        {
+            fprintf(stderr, "[server] Only the built-in MIME types are "
+                    "known\n");
+        }
+        if(-1 == handler_init())
+        {
+            _exit(EXIT_FAILURE);
+        }
+        if(g_conf.pack_on && -1 == pack_open(g_conf.pack))
+        {
+            fprintf(stderr, "[server] Files are served from the document "
+                    "root only\n");
+        }
         if(-1 == chroot(g_conf.document_root))
         {
             perror("[server] chroot()");
             _exit(EXIT_FAILURE);
         }
         drop_privileges(p.p_uid, p.p_gid);
+        // before the workers, which share what it publishes
+        if(g_conf.watch_on && 0 != g_conf.cache_max_mem
+                && -1 == watch_start())
+        {
+            fprintf(stderr, "[server] Cached files are checked with stat()\n");
+        }
 
         init_workers();
-        rv = run_server(listensocket);
-        reap_workers();
+        // the manager lets the previous generation go now
+        kill(getppid(), SIGUSR1);
+        rv = (-1 != listensocket)
+            ? run_server(listensocket)
+            : supervise_workers();
+        if(is_draining_needed() && !is_reaping_needed())
+        {
+            // the workers hold the last SO_REUSEPORT sockets of this
+            // generation then, and close them once their queues are empty
+            if(g_conf.reuse_port)
+                free_listeners(&g_listeners);
+            drain_workers();
+        }
+        else
+            reap_workers();
         _exit(rv);
     }
     return servpid;
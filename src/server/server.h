@@ -1,6 +1,13 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+// opens the listening sockets of the config unless the ones which are
+// open already fit it; returns -1 on a failure
+int
+open_listeners();
+
+// forks a server process which serves on the listening sockets; it sends
+// SIGUSR1 to the caller once its workers are running
 int
 runservinproc();
 
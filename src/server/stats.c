@@ -0,0 +1,344 @@
+#include "server/stats.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** A relaxed store is enough for a counter with a single writer: readers
+ *  see either the old or the new value, and no bus lock is taken */
+#define STATS_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+static const int STATUS_CODES[STATS_NSTATUS] = {
+    200, 206, 304, 400, 403, 404, 416, 500, 501, 505
+};
+
+static struct stats_segment* g_seg;
+
+/** Updates go here until a worker is attached to its slot */
+static struct stats_worker g_unattached;
+static struct stats_worker* g_self = &g_unattached;
+
+static size_t
+segment_size(int nworkers)
+{
+    return sizeof(struct stats_segment)
+        + nworkers * sizeof(struct stats_worker);
+}
+
+int
+stats_create(int nworkers)
+{
+    int fd;
+    size_t size = segment_size(nworkers);
+
+    // a fresh segment: the workers of a previous generation may still be
+    // draining and updating theirs
+    shm_unlink(STATS_SHM_NAME);
+    // readable by anybody for the reader tool, written by the workers only
+    fd = shm_open(STATS_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(-1 == fd)
+    {
+        perror("[stats] shm_open");
+        return -1;
+    }
+    if(-1 == fchmod(fd, 0644) || -1 == ftruncate(fd, size))
+    {
+        perror("[stats] ftruncate");
+        close(fd);
+        shm_unlink(STATS_SHM_NAME);
+        return -1;
+    }
+    g_seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == g_seg)
+    {
+        perror("[stats] mmap");
+        g_seg = NULL;
+        shm_unlink(STATS_SHM_NAME);
+        return -1;
+    }
+    g_seg->s_nworkers = nworkers;
+    g_seg->s_started = time(NULL);
+    __atomic_store_n(&g_seg->s_magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+stats_destroy()
+{
+    shm_unlink(STATS_SHM_NAME);
+}
+
+void
+stats_attach(int wid)
+{
+    if(NULL != g_seg && (unsigned int) wid < g_seg->s_nworkers)
+    {
+        g_self = &g_seg->s_workers[wid];
+        // connections of a dead predecessor are gone
+        __atomic_store_n(&g_self->s_active, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_self->s_backlog, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_self->s_pid, (long) getpid(), __ATOMIC_RELAXED);
+    }
+}
+
+const struct stats_segment*
+stats_open()
+{
+    int fd;
+    struct stat st;
+    struct stats_segment* seg;
+
+    if(-1 == (fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0)))
+        return NULL;
+    if(-1 == fstat(fd, &st) || (size_t) st.st_size < segment_size(0))
+    {
+        close(fd);
+        return NULL;
+    }
+    seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == seg)
+        return NULL;
+    if(STATS_MAGIC != __atomic_load_n(&seg->s_magic, __ATOMIC_ACQUIRE)
+            || (size_t) st.st_size < segment_size(seg->s_nworkers))
+    {
+        munmap(seg, st.st_size);
+        return NULL;
+    }
+    return seg;
+}
+
+const struct stats_segment*
+stats_shared()
+{
+    return g_seg;
+}
+
+void
+stats_accepted()
+{
+    STATS_ADD(g_self->s_accepted, 1);
+    STATS_ADD(g_self->s_active, 1);
+}
+
+void
+stats_closed()
+{
+    STATS_ADD(g_self->s_active, -1);
+}
+
+void
+stats_backlog(int n)
+{
+    STATS_ADD(g_self->s_backlog, n);
+}
+
+void
+stats_received()
+{
+    STATS_ADD(g_self->s_received, 1);
+}
+
+void
+stats_response(int code)
+{
+    int i;
+
+    STATS_ADD(g_self->s_requests, 1);
+    for(i = 0; i < STATS_NSTATUS; ++i)
+    {
+        if(STATUS_CODES[i] == code)
+        {
+            STATS_ADD(g_self->s_status[i], 1);
+            break;
+        }
+    }
+}
+
+void
+stats_latency(unsigned long usec)
+{
+    int i;
+
+    for(i = 0; i < STATS_NBUCKETS - 1 && usec >= (16UL << i); ++i)
+        ;
+    STATS_ADD(g_self->s_latency[i], 1);
+}
+
+void
+stats_sent(size_t bytes)
+{
+    STATS_ADD(g_self->s_bytes_sent, bytes);
+}
+
+void
+stats_cache(int hit)
+{
+    if(hit)
+        STATS_ADD(g_self->s_cache_hits, 1);
+    else
+        STATS_ADD(g_self->s_cache_misses, 1);
+}
+
+void
+stats_log_dropped()
+{
+    STATS_ADD(g_self->s_log_dropped, 1);
+}
+
+/** A bounded appender: keeps counting the length once the buffer is full */
+struct report
+{
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static void
+put(struct report* r, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(r->buf + ((r->len < r->size) ? r->len : r->size),
+            (r->len < r->size) ? r->size - r->len : 0, fmt, ap);
+    va_end(ap);
+    if(0 < n)
+        r->len += n;
+}
+
+static void
+put_counter(struct report* r, const char* prefix, const char* name,
+            unsigned long value, int json)
+{
+    if(json)
+        put(r, "%s\"%s\": %lu", prefix, name, value);
+    else
+        put(r, "%s%s: %lu\n", prefix, name, value);
+}
+
+static void
+put_counters(struct report* r, const struct stats_worker* w, int json,
+             const char* indent)
+{
+    char name[32];
+    const char* sep = json ? ", " : indent;
+    int i;
+
+    put_counter(r, json ? "" : indent, "accepted", w->s_accepted, json);
+    put_counter(r, sep, "active", w->s_active, json);
+    put_counter(r, sep, "backlog", w->s_backlog, json);
+    put_counter(r, sep, "received", w->s_received, json);
+    put_counter(r, sep, "requests", w->s_requests, json);
+    put_counter(r, sep, "bytes_sent", w->s_bytes_sent, json);
+    put_counter(r, sep, "cache_hits", w->s_cache_hits, json);
+    put_counter(r, sep, "cache_misses", w->s_cache_misses, json);
+    put_counter(r, sep, "log_dropped", w->s_log_dropped, json);
+
+    if(json)
+        put(r, ", \"status\": {");
+    for(i = 0; i < STATS_NSTATUS; ++i)
+    {
+        snprintf(name, sizeof(name), json ? "%d" : "status_%d",
+                STATUS_CODES[i]);
+        put_counter(r, (json && 0 == i) ? "" : sep, name, w->s_status[i],
+                json);
+    }
+
+    if(json)
+        put(r, "}, \"latency_us\": {");
+    for(i = 0; i < STATS_NBUCKETS; ++i)
+    {
+        if(i < STATS_NBUCKETS - 1)
+            snprintf(name, sizeof(name),
+                    json ? "lt_%lu" : "latency_lt_%luus", 16UL << i);
+        else
+            snprintf(name, sizeof(name), json ? "rest" : "latency_rest");
+        put_counter(r, (json && 0 == i) ? "" : sep, name, w->s_latency[i],
+                json);
+    }
+    if(json)
+        put(r, "}");
+}
+
+/** Takes a consistent enough copy of a slot which is being updated */
+static void
+load_slot(struct stats_worker* to, const struct stats_worker* from)
+{
+    const unsigned long* src = (const unsigned long*) from;
+    unsigned long* dst = (unsigned long*) to;
+    size_t i;
+
+    for(i = 0; i < sizeof(*to) / sizeof(*dst); ++i)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void
+add_slot(struct stats_worker* to, const struct stats_worker* w)
+{
+    int i;
+
+    to->s_accepted += w->s_accepted;
+    to->s_active += w->s_active;
+    to->s_backlog += w->s_backlog;
+    to->s_received += w->s_received;
+    to->s_requests += w->s_requests;
+    to->s_bytes_sent += w->s_bytes_sent;
+    to->s_cache_hits += w->s_cache_hits;
+    to->s_cache_misses += w->s_cache_misses;
+    to->s_log_dropped += w->s_log_dropped;
+    for(i = 0; i < STATS_NSTATUS; ++i)
+        to->s_status[i] += w->s_status[i];
+    for(i = 0; i < STATS_NBUCKETS; ++i)
+        to->s_latency[i] += w->s_latency[i];
+}
+
+size_t
+stats_format(const struct stats_segment* seg, char* buf, size_t size,
+             int json)
+{
+    struct report r = {buf, size, 0};
+    struct stats_worker total;
+    struct stats_worker w;
+    unsigned int i;
+    long uptime = time(NULL) - seg->s_started;
+
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < seg->s_nworkers; ++i)
+    {
+        load_slot(&w, &seg->s_workers[i]);
+        add_slot(&total, &w);
+    }
+
+    if(json)
+        put(&r, "{\"uptime\": %ld, \"workers\": %u, \"total\": {",
+                uptime, seg->s_nworkers);
+    else
+        put(&r, "uptime: %ld\nworkers: %u\n", uptime, seg->s_nworkers);
+    put_counters(&r, &total, json, "");
+
+    if(json)
+        put(&r, "}, \"per_worker\": [");
+    for(i = 0; i < seg->s_nworkers; ++i)
+    {
+        load_slot(&w, &seg->s_workers[i]);
+        if(json)
+            put(&r, "%s{\"id\": %u, \"pid\": %ld, ", i ? ", " : "", i,
+                    w.s_pid);
+        else
+            put(&r, "worker %u:\n  pid: %ld\n", i, w.s_pid);
+        put_counters(&r, &w, json, "  ");
+        if(json)
+            put(&r, "}");
+    }
+    if(json)
+        put(&r, "]}\n");
+    return r.len;
+}
@@ -0,0 +1,100 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define STATS_SHM_NAME "/webserver.stats"
+#define STATS_MAGIC 0x57535431 // "WST1"
+
+/** Status codes the server answers with, in the order of s_status */
+#define STATS_NSTATUS 10
+/** Bucket i of the latency histogram counts responses which took less
+ *  than (16 << i) microseconds, the last one counts the rest */
+#define STATS_NBUCKETS 20
+
+/** Counters of a single worker. Only that worker writes them, so updates
+ *  are plain relaxed stores, and every slot takes its own cache lines to
+ *  keep the workers from invalidating each other's */
+struct stats_worker
+{
+    long s_pid;
+    unsigned long s_accepted;
+    unsigned long s_active;
+    unsigned long s_backlog;    // active ones waiting for the socket to drain
+    unsigned long s_received;   // connections passed by the server process
+    unsigned long s_requests;
+    unsigned long s_status[STATS_NSTATUS];
+    unsigned long s_bytes_sent;
+    unsigned long s_cache_hits;
+    unsigned long s_cache_misses;
+    unsigned long s_log_dropped; // access log records lost to overflow
+    unsigned long s_latency[STATS_NBUCKETS];
+} __attribute__((aligned(64)));
+
+/** The shared memory segment created by the server process */
+struct stats_segment
+{
+    unsigned int s_magic;
+    unsigned int s_nworkers;
+    long s_started;     // time() the server has been started at
+    struct stats_worker s_workers[];
+};
+
+// creates the segment before the workers are forked, -1 on a failure
+int
+stats_create(int nworkers);
+
+// removes the segment, the server can not do that from its chroot
+void
+stats_destroy();
+
+// makes the calling worker update the slot wid
+void
+stats_attach(int wid);
+
+// maps the segment of a running server read-only, NULL on a failure
+const struct stats_segment*
+stats_open();
+
+// the segment of this server, NULL if there is none
+const struct stats_segment*
+stats_shared();
+
+// prints totals and per-worker counters as plain text or JSON; returns
+// the length the whole report needs, like snprintf() does
+size_t
+stats_format(const struct stats_segment* seg, char* buf, size_t size,
+             int json);
+
+void
+stats_accepted();
+
+void
+stats_closed();
+
+// n is 1 when a response of a connection stops fitting into the socket
+// and -1 when the connection catches up or closes
+void
+stats_backlog(int n);
+
+void
+stats_received();
+
+// counts a response with the HTTP status code
+void
+stats_response(int code);
+
+void
+stats_latency(unsigned long usec);
+
+void
+stats_sent(size_t bytes);
+
+void
+stats_cache(int hit);
+
+void
+stats_log_dropped();
+
+#endif
@@ -0,0 +1,184 @@
+#include "server/timer.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define LEVEL_SPAN(n) (1UL << (WHEEL_BITS * (n)))
+
+static void
+list_init(struct timer* head)
+{
+    head->t_next = head->t_prev = head;
+}
+
+static void
+list_add(struct timer* head, struct timer* t)
+{
+    t->t_prev = head->t_prev;
+    t->t_next = head;
+    head->t_prev->t_next = t;
+    head->t_prev = t;
+}
+
+static void
+list_del(struct timer* t)
+{
+    t->t_prev->t_next = t->t_next;
+    t->t_next->t_prev = t->t_prev;
+    t->t_next = t->t_prev = NULL;
+}
+
+static void
+place_timer(struct timer_wheel* w, struct timer* t)
+{
+    int level;
+    unsigned long delta;
+
+    if(t->t_expires < w->w_tick)
+        t->t_expires = w->w_tick; // overdue, fires on the next tick
+    delta = t->t_expires - w->w_tick;
+    if(delta >= LEVEL_SPAN(WHEEL_LEVELS))
+    {
+        delta = LEVEL_SPAN(WHEEL_LEVELS) - 1;
+        t->t_expires = w->w_tick + delta;
+    }
+
+    for(level = 0; delta >= LEVEL_SPAN(level + 1); ++level)
+        ;
+    list_add(&w->w_slots[level]
+            [(t->t_expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+/** Moves the timers of one slot of a level down to the lower levels */
+static unsigned long
+cascade(struct timer_wheel* w, int level)
+{
+    unsigned long i = (w->w_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    struct timer* head = &w->w_slots[level][i];
+    struct timer list;
+    struct timer* t;
+
+    if(head->t_next == head)
+        return i;
+    // detach the slot first: timers may be placed back into it
+    list.t_next = head->t_next;
+    list.t_prev = head->t_prev;
+    list.t_next->t_prev = list.t_prev->t_next = &list;
+    list_init(head);
+
+    while(list.t_next != &list)
+    {
+        t = list.t_next;
+        list_del(t);
+        place_timer(w, t);
+    }
+    return i;
+}
+
+void
+timer_init(struct timer* t, void* data)
+{
+    t->t_next = t->t_prev = NULL;
+    t->t_expires = 0;
+    t->t_data = data;
+}
+
+void
+timer_wheel_init(struct timer_wheel* w, unsigned long now_ms)
+{
+    int i;
+    int j;
+
+    for(i = 0; i < WHEEL_LEVELS; ++i)
+    {
+        for(j = 0; j < WHEEL_SIZE; ++j)
+            list_init(&w->w_slots[i][j]);
+    }
+    w->w_tick = now_ms / TIMER_TICK_MS;
+    w->w_clock_ms = now_ms;
+    w->w_count = 0;
+}
+
+void
+timer_add(struct timer_wheel* w, struct timer* t, unsigned long timeout_ms)
+{
+    if(NULL != t->t_next)
+        list_del(t);
+    else if(0 == w->w_count++)
+        w->w_tick = w->w_clock_ms / TIMER_TICK_MS; // skip the idle ticks
+    // rounded up, a timer never fires early
+    t->t_expires = (w->w_clock_ms + timeout_ms + TIMER_TICK_MS - 1)
+        / TIMER_TICK_MS;
+    place_timer(w, t);
+}
+
+void
+timer_del(struct timer_wheel* w, struct timer* t)
+{
+    if(NULL != t->t_next)
+    {
+        list_del(t);
+        --w->w_count;
+    }
+}
+
+int
+timer_next_timeout(const struct timer_wheel* w)
+{
+    unsigned long i;
+    unsigned long ticks;
+    unsigned long due;
+
+    if(0 == w->w_count)
+        return -1;
+
+    // the first busy slot of the lowest level or the next cascade
+    for(ticks = 0; ticks < WHEEL_SIZE; ++ticks)
+    {
+        i = (w->w_tick + ticks) & WHEEL_MASK;
+        if(0 == i || w->w_slots[0][i].t_next != &w->w_slots[0][i])
+            break;
+    }
+    due = (w->w_tick + ticks) * TIMER_TICK_MS;
+    return (due > w->w_clock_ms) ? (int) (due - w->w_clock_ms) : 0;
+}
+
+void
+timer_set_clock(struct timer_wheel* w, unsigned long now_ms)
+{
+    w->w_clock_ms = now_ms;
+}
+
+void
+timer_expire(struct timer_wheel* w, void (*fn)(struct timer*, void*),
+             void* arg)
+{
+    int level;
+    unsigned long i;
+    unsigned long now = w->w_clock_ms / TIMER_TICK_MS;
+    struct timer* head;
+    struct timer* t;
+
+    if(0 == w->w_count)
+    {
+        // nothing to cascade, just catch up with the clock
+        if(now >= w->w_tick)
+            w->w_tick = now + 1;
+        return;
+    }
+
+    while(now >= w->w_tick)
+    {
+        i = w->w_tick & WHEEL_MASK;
+        for(level = 1; 0 == i && level < WHEEL_LEVELS; ++level)
+            i = cascade(w, level);
+
+        head = &w->w_slots[0][w->w_tick & WHEEL_MASK];
+        ++w->w_tick;
+        while(head->t_next != head)
+        {
+            t = head->t_next;
+            list_del(t);
+            --w->w_count;
+            fn(t, arg);
+        }
+    }
+}
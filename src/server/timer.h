@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+
+/** Resolution of the wheel */
+#define TIMER_TICK_MS 100
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/** A timer is embedded into the object it belongs to; t_next is NULL
+ *  while the timer is not armed */
+struct timer
+{
+    struct timer* t_next;
+    struct timer* t_prev;
+    unsigned long t_expires; // in ticks
+    void* t_data;
+};
+
+/** A hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots,
+ *  each slot of a level spans a whole turn of the level below. Timers are
+ *  added and removed in O(1), and they are moved down a level at most
+ *  WHEEL_LEVELS - 1 times before they expire. */
+struct timer_wheel
+{
+    unsigned long w_tick;     // the next tick to be processed
+    unsigned long w_clock_ms; // timers are armed relative to it
+    size_t w_count;
+    struct timer w_slots[WHEEL_LEVELS][WHEEL_SIZE]; // list heads
+};
+
+void
+timer_init(struct timer* t, void* data);
+
+void
+timer_wheel_init(struct timer_wheel* w, unsigned long now_ms);
+
+// (re)arms the timer to fire in timeout_ms after the wheel's clock
+void
+timer_add(struct timer_wheel* w, struct timer* t, unsigned long timeout_ms);
+
+void
+timer_del(struct timer_wheel* w, struct timer* t);
+
+// returns milliseconds until the wheel has to be advanced, -1 if it
+// has no timers at all; a timeout for epoll_wait()
+int
+timer_next_timeout(const struct timer_wheel* w);
+
+void
+timer_set_clock(struct timer_wheel* w, unsigned long now_ms);
+
+// advances the wheel to its clock and calls fn for every expired timer;
+// the timer is disarmed before the call, so fn may free it
+void
+timer_expire(struct timer_wheel* w, void (*fn)(struct timer*, void*),
+             void* arg);
+
+#endif
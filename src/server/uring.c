@@ -0,0 +1,267 @@
+#include "server/uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                   unsigned int flags, void* arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            arg, argsz);
+}
+
+int
+uring_init(struct uring* r, unsigned int entries)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_update reg;
+    char* sq;
+    char* cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    // the worker is the only submitter, completions are reaped on its
+    // own io_uring_enter() calls instead of interrupting it
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+        | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+    if(-1 == (r->r_fd = sys_io_uring_setup(entries, &p)) && EINVAL == errno)
+    {
+        // an older kernel
+        p.flags = IORING_SETUP_CQSIZE;
+        r->r_fd = sys_io_uring_setup(entries, &p);
+    }
+    if(-1 == r->r_fd)
+    {
+        perror("[uring] io_uring_setup");
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)
+            || !(p.features & IORING_FEAT_EXT_ARG)
+            || !(p.features & IORING_FEAT_NODROP))
+    {
+        fprintf(stderr, "[uring] The kernel is too old\n");
+        close(r->r_fd);
+        return -1;
+    }
+
+    r->r_sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->r_cq_map_len = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(r->r_cq_map_len > r->r_sq_map_len)
+        r->r_sq_map_len = r->r_cq_map_len;
+    r->r_sq_map = mmap(NULL, r->r_sq_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->r_fd, IORING_OFF_SQ_RING);
+    if(MAP_FAILED == r->r_sq_map)
+    {
+        perror("[uring] mmap");
+        close(r->r_fd);
+        return -1;
+    }
+    r->r_cq_map = r->r_sq_map; // IORING_FEAT_SINGLE_MMAP
+    r->r_cq_map_len = 0;
+
+    r->r_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->r_sqes = mmap(NULL, r->r_sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->r_fd, IORING_OFF_SQES);
+    if(MAP_FAILED == r->r_sqes)
+    {
+        perror("[uring] mmap");
+        munmap(r->r_sq_map, r->r_sq_map_len);
+        close(r->r_fd);
+        return -1;
+    }
+
+    sq = r->r_sq_map;
+    r->r_sq_head = (unsigned int*) (sq + p.sq_off.head);
+    r->r_sq_tail = (unsigned int*) (sq + p.sq_off.tail);
+    r->r_sq_mask = *(unsigned int*) (sq + p.sq_off.ring_mask);
+    r->r_sq_entries = p.sq_entries;
+    r->r_sq_array = (unsigned int*) (sq + p.sq_off.array);
+
+    cq = r->r_cq_map;
+    r->r_cq_head = (unsigned int*) (cq + p.cq_off.head);
+    r->r_cq_tail = (unsigned int*) (cq + p.cq_off.tail);
+    r->r_cq_mask = *(unsigned int*) (cq + p.cq_off.ring_mask);
+    r->r_cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // saves looking the ring up by its descriptor on every enter
+    r->r_enter_fd = r->r_fd;
+    memset(&reg, 0, sizeof(reg));
+    reg.offset = -1U;
+    reg.data = r->r_fd;
+    if(1 == uring_register(r, IORING_REGISTER_RING_FDS, &reg, 1))
+    {
+        r->r_enter_fd = reg.offset;
+        r->r_enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+    return 0;
+}
+
+void
+uring_exit(struct uring* r)
+{
+    munmap(r->r_sqes, r->r_sqes_len);
+    munmap(r->r_sq_map, r->r_sq_map_len);
+    close(r->r_fd);
+}
+
+int
+uring_register(struct uring* r, unsigned int opcode, void* arg,
+               unsigned int nargs)
+{
+    return syscall(__NR_io_uring_register, r->r_fd, opcode, arg, nargs);
+}
+
+static int
+enter(struct uring* r, unsigned int min_complete, unsigned int flags,
+      void* arg, size_t argsz)
+{
+    int n;
+
+    n = sys_io_uring_enter(r->r_enter_fd, r->r_sq_pending, min_complete,
+            flags | r->r_enter_flags, arg, argsz);
+    if(0 < n)
+        r->r_sq_pending -= n;
+    return n;
+}
+
+int
+uring_reserve(struct uring* r, unsigned int n)
+{
+    unsigned int tail = *r->r_sq_tail;
+    unsigned int head = __atomic_load_n(r->r_sq_head, __ATOMIC_ACQUIRE);
+
+    if(r->r_sq_entries - (tail - head) >= n)
+        return 0;
+    if(-1 == enter(r, 0, 0, NULL, 0) && EINTR != errno)
+    {
+        perror("[uring] io_uring_enter");
+        return -1;
+    }
+    head = __atomic_load_n(r->r_sq_head, __ATOMIC_ACQUIRE);
+    return (r->r_sq_entries - (tail - head) >= n) ? 0 : -1;
+}
+
+struct io_uring_sqe*
+uring_sqe(struct uring* r)
+{
+    unsigned int tail;
+    struct io_uring_sqe* sqe;
+
+    if(-1 == uring_reserve(r, 1))
+        return NULL;
+    tail = *r->r_sq_tail;
+    sqe = &r->r_sqes[tail & r->r_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->r_sq_array[tail & r->r_sq_mask] = tail & r->r_sq_mask;
+    __atomic_store_n(r->r_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->r_sq_pending;
+    return sqe;
+}
+
+int
+uring_submit_and_wait(struct uring* r, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if(0 <= timeout_ms)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (unsigned long) &ts;
+    }
+    if(-1 == enter(r, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg)) && ETIME != errno)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe*
+uring_peek_cqe(struct uring* r)
+{
+    unsigned int head = *r->r_cq_head;
+
+    if(head == __atomic_load_n(r->r_cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->r_cqes[head & r->r_cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring* r)
+{
+    __atomic_store_n(r->r_cq_head, *r->r_cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+uring_bufs_init(struct uring* r, struct uring_bufs* b, unsigned short group,
+                unsigned int entries, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_len = entries * sizeof(struct io_uring_buf);
+    unsigned int i;
+
+    memset(b, 0, sizeof(*b));
+    b->b_ring = mmap(NULL, ring_len + entries * size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == b->b_ring)
+    {
+        perror("[uring] mmap");
+        return -1;
+    }
+    b->b_mem = (char*) b->b_ring + ring_len;
+    b->b_size = size;
+    b->b_entries = entries;
+    b->b_group = group;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) b->b_ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if(0 != uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        perror("[uring] IORING_REGISTER_PBUF_RING");
+        munmap(b->b_ring, ring_len + entries * size);
+        return -1;
+    }
+
+    for(i = 0; i < entries; ++i)
+        uring_buf_recycle(b, i);
+    return 0;
+}
+
+char*
+uring_buf(const struct uring_bufs* b, unsigned int id)
+{
+    return b->b_mem + id * b->b_size;
+}
+
+void
+uring_buf_recycle(struct uring_bufs* b, unsigned int id)
+{
+    struct io_uring_buf* buf
+        = &b->b_ring->bufs[b->b_tail & (b->b_entries - 1)];
+
+    buf->addr = (unsigned long) uring_buf(b, id);
+    buf->len = b->b_size;
+    buf->bid = id;
+    __atomic_store_n(&b->b_ring->tail, ++b->b_tail, __ATOMIC_RELEASE);
+}
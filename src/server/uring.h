@@ -0,0 +1,87 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/** A bare io_uring instance driven with raw system calls */
+struct uring
+{
+    int r_fd;
+    int r_enter_fd;     // an index into the registered ring table or r_fd
+    unsigned int r_enter_flags;
+
+    unsigned int* r_sq_head;
+    unsigned int* r_sq_tail;
+    unsigned int* r_sq_array;
+    unsigned int r_sq_mask;
+    unsigned int r_sq_entries;
+    unsigned int r_sq_pending; // prepared, but not yet submitted
+    struct io_uring_sqe* r_sqes;
+
+    unsigned int* r_cq_head;
+    unsigned int* r_cq_tail;
+    unsigned int r_cq_mask;
+    struct io_uring_cqe* r_cqes;
+
+    void* r_sq_map;
+    size_t r_sq_map_len;
+    void* r_cq_map;
+    size_t r_cq_map_len;
+    size_t r_sqes_len;
+};
+
+/** A ring of buffers the kernel picks from for IOSQE_BUFFER_SELECT */
+struct uring_bufs
+{
+    struct io_uring_buf_ring* b_ring;
+    char* b_mem;
+    size_t b_size;      // of a single buffer
+    unsigned int b_entries;
+    unsigned short b_group;
+    unsigned short b_tail;
+};
+
+int
+uring_init(struct uring* r, unsigned int entries);
+
+void
+uring_exit(struct uring* r);
+
+int
+uring_register(struct uring* r, unsigned int opcode, void* arg,
+               unsigned int nargs);
+
+// returns a zeroed submission entry; a full queue is submitted first
+struct io_uring_sqe*
+uring_sqe(struct uring* r);
+
+// makes sure that n entries can be taken without a submission between
+// them, which would break a chain of linked entries
+int
+uring_reserve(struct uring* r, unsigned int n);
+
+// submits pending entries and waits for a completion at most timeout_ms
+// (-1 waits indefinitely); returns -1 and sets errno on failure
+int
+uring_submit_and_wait(struct uring* r, int timeout_ms);
+
+// returns the next completion or NULL, uring_cqe_seen() releases it
+struct io_uring_cqe*
+uring_peek_cqe(struct uring* r);
+
+void
+uring_cqe_seen(struct uring* r);
+
+int
+uring_bufs_init(struct uring* r, struct uring_bufs* b, unsigned short group,
+                unsigned int entries, size_t size);
+
+char*
+uring_buf(const struct uring_bufs* b, unsigned int id);
+
+// gives the buffer back to the kernel
+void
+uring_buf_recycle(struct uring_bufs* b, unsigned int id);
+
+#endif
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "server/cache.h"
+#include "server/watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE \
+        | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF \
+        | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_BUF_SIZE (64 * 1024)
+
+static struct watch_shared* g_shared;
+static int g_ifd = -1;
+static pthread_t g_watcher;
+
+/** Watched directories by watch descriptor, relative to the root
+ *  ("" for the root itself) */
+static char** g_dirs;
+static int g_ndirs;
+
+/** The last path published for the batch of events being handled */
+static unsigned int g_last;
+static int g_has_last;
+
+const struct watch_shared*
+watch_shared()
+{
+    return g_shared;
+}
+
+static void
+publish(const char* path)
+{
+    unsigned int h = cache_hash_path(path);
+    unsigned long seq = g_shared->w_seq;
+
+    // a burst of writes to a file is published once per batch, which is
+    // only read after all of them have happened
+    if(g_has_last && h == g_last)
+        return;
+    g_last = h;
+    g_has_last = 1;
+    __atomic_store_n(&g_shared->w_paths[seq & (WATCH_RING_SIZE - 1)], h,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&g_shared->w_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+flush_all()
+{
+    __atomic_add_fetch(&g_shared->w_flush, 1, __ATOMIC_RELEASE);
+}
+
+static void
+deactivate()
+{
+    fprintf(stderr, "[watch] Changes may be missed, cached files are "
+            "checked with stat() again\n");
+    __atomic_store_n(&g_shared->w_active, 0, __ATOMIC_RELEASE);
+}
+
+/** Puts "dir/name" into buf; returns -1 if it does not fit */
+static int
+join(char* buf, size_t size, const char* dir, const char* name)
+{
+    size_t n = (size_t) snprintf(buf, size, "%s%s%s", dir,
+            ('\0' != *dir) ? "/" : "", name);
+
+    return (n < size) ? 0 : -1;
+}
+
+static int
+set_dir(int wd, const char* rel)
+{
+    char** dirs;
+    char* copy;
+
+    if(wd >= g_ndirs)
+    {
+        if(NULL == (dirs = realloc(g_dirs, (wd + 1) * sizeof(*dirs))))
+            return -1;
+        memset(dirs + g_ndirs, 0, (wd + 1 - g_ndirs) * sizeof(*dirs));
+        g_dirs = dirs;
+        g_ndirs = wd + 1;
+    }
+    if(NULL == (copy = strdup(rel)))
+        return -1;
+    // a directory which has been moved keeps its descriptor
+    free(g_dirs[wd]);
+    g_dirs[wd] = copy;
+    return 0;
+}
+
+/** Watches the directory and the ones beneath it */
+static int
+add_tree(const char* rel)
+{
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    DIR* d;
+    int wd;
+    int isdir;
+    int rv = 0;
+
+    // the server process is chrooted to the document root
+    if((size_t) snprintf(path, sizeof(path), "/%s", rel) >= sizeof(path))
+        return -1;
+
+    if(-1 == (wd = inotify_add_watch(g_ifd, path, WATCH_MASK)))
+    {
+        if(ENOENT == errno || ENOTDIR == errno)
+            return 0; // it is gone already
+        perror("[watch] inotify_add_watch");
+        if(ENOSPC == errno)
+            fprintf(stderr, "[watch] fs.inotify.max_user_watches is too "
+                    "low for the document root\n");
+        return -1;
+    }
+    if(-1 == set_dir(wd, rel))
+    {
+        perror("[watch] malloc");
+        return -1;
+    }
+
+    if(NULL == (d = opendir(path)))
+    {
+        if(ENOENT == errno || ENOTDIR == errno)
+            return 0;
+        perror("[watch] opendir");
+        return -1;
+    }
+    while(0 == rv && NULL != (de = readdir(d)))
+    {
+        if(0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, ".."))
+            continue;
+        isdir = (DT_DIR == de->d_type) || (DT_UNKNOWN == de->d_type
+                && 0 == fstatat(dirfd(d), de->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode));
+        if(!isdir)
+            continue;
+        if(-1 == join(child, sizeof(child), rel, de->d_name))
+            continue; // nothing beneath could be requested anyway
+        rv = add_tree(child);
+    }
+    closedir(d);
+    return rv;
+}
+
+static void
+handle_event(const struct inotify_event* ev)
+{
+    char path[PATH_MAX];
+    const char* dir;
+    size_t len;
+
+    if(0 != (IN_Q_OVERFLOW & ev->mask))
+    {
+        flush_all();
+        return;
+    }
+    if(ev->wd < 0 || ev->wd >= g_ndirs || NULL == (dir = g_dirs[ev->wd]))
+        return;
+    if(0 != (IN_IGNORED & ev->mask))
+    {
+        free(g_dirs[ev->wd]);
+        g_dirs[ev->wd] = NULL;
+        return;
+    }
+
+    if(0 != ((IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF) & ev->mask))
+    {
+        // anything beneath the directory may have changed
+        if(0 != ((IN_CREATE | IN_MOVED_TO) & ev->mask) && 0 != ev->len
+                && 0 == join(path, sizeof(path), dir, ev->name)
+                && -1 == add_tree(path))
+            deactivate();
+        flush_all();
+        return;
+    }
+    if(0 == ev->len || -1 == join(path, sizeof(path), dir, ev->name))
+        return;
+
+    publish(path);
+    // the original keeps track of which sidecars it has
+    len = strlen(path);
+    if(len > 3 && (0 == strcmp(path + len - 3, ".gz")
+                || 0 == strcmp(path + len - 3, ".br")))
+    {
+        path[len - 3] = '\0';
+        publish(path);
+    }
+}
+
+static void*
+watcher_routine(void* arg)
+{
+    char buf[WATCH_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* ev;
+    ssize_t n;
+    char* p;
+
+    (void) arg;
+    while(1)
+    {
+        if(-1 == (n = read(g_ifd, buf, sizeof(buf))))
+        {
+            if(EINTR == errno)
+                continue;
+            perror("[watch] read");
+            deactivate();
+            return NULL;
+        }
+        g_has_last = 0;
+        for(p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event*) p;
+            handle_event(ev);
+        }
+    }
+}
+
+static void
+free_dirs()
+{
+    int i;
+
+    for(i = 0; i < g_ndirs; ++i)
+        free(g_dirs[i]);
+    free(g_dirs);
+    g_dirs = NULL;
+    g_ndirs = 0;
+}
+
+int
+watch_start()
+{
+    sigset_t all;
+    sigset_t old;
+    int rv;
+
+    g_shared = mmap(NULL, sizeof(*g_shared), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == g_shared)
+    {
+        perror("[watch] mmap");
+        g_shared = NULL;
+        return -1;
+    }
+    if(-1 == (g_ifd = inotify_init1(IN_CLOEXEC)))
+    {
+        perror("[watch] inotify_init1");
+        goto fail;
+    }
+    if(-1 == add_tree(""))
+        goto fail;
+    g_shared->w_active = 1;
+
+    // signals are for the main thread of the server
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rv = pthread_create(&g_watcher, NULL, watcher_routine, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(0 != rv)
+    {
+        fprintf(stderr, "[watch] pthread_create: %s\n", strerror(rv));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if(-1 != g_ifd)
+        close(g_ifd);
+    g_ifd = -1;
+    free_dirs();
+    munmap(g_shared, sizeof(*g_shared));
+    g_shared = NULL;
+    return -1;
+}
+
+void
+watch_close_inherited()
+{
+    // the watcher thread is not forked along
+    if(-1 != g_ifd)
+        close(g_ifd);
+    g_ifd = -1;
+}
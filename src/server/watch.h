@@ -0,0 +1,34 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/** Paths a worker may lag behind before it drops its whole cache,
+ *  a power of two */
+#define WATCH_RING_SIZE 1024
+
+/** Changes under the document root, published by a thread of the server
+ *  process into memory shared with its workers. Paths are published as
+ *  cache_hash_path() of their normalized form. */
+struct watch_shared
+{
+    unsigned long w_seq;        // paths published so far
+    unsigned long w_flush;      // bumped when everything is stale
+    int w_active;               // 0 once changes could be missed
+    unsigned int w_paths[WATCH_RING_SIZE];
+};
+
+// watches the document tree (the root of the chrooted server process) and
+// starts the thread which publishes its changes; returns -1 if the tree can
+// not be watched
+int
+watch_start();
+
+// closes the inotify descriptor in a forked worker, which only reads the
+// shared memory
+void
+watch_close_inherited();
+
+// NULL unless the watcher has been started
+const struct watch_shared*
+watch_shared();
+
+#endif
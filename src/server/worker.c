@@ -1,32 +1,111 @@
+#define _GNU_SOURCE
+#include "config/conf.h"
+#include "server/affinity.h"
+#include "server/cache.h"
 #include "server/worker.h"
 #include "server/handler.h"
+#include "server/log.h"
+#include "server/output.h"
+#include "server/stats.h"
+#include "server/timer.h"
+#include "server/uring.h"
+#include "server/watch.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/tcp.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-typedef unsigned char wid_t;
-#define WORKERS_CNT 4 
+typedef unsigned int wid_t;
+#define MAX_EVENTS 256
+#define RECV_BUF_SIZE 4096
+/** Submission queue size of the io_uring engine */
+#define URING_ENTRIES 256
+/** Buffers the kernel receives client data into */
+#define URING_RECV_BUFS 128
+/** Registered buffers files are read into before they are sent */
+#define URING_STAGE_SIZE 65536
+#define URING_STAGE_BUFS 32
+/** Received data held back from c_buf before receiving is paused */
+#define SPILL_MAX (4 * RECV_BUF_SIZE)
+/** How often a draining worker checks whether it is done */
+#define DRAIN_CHECK_MS 100
+
+/** Config for the whole program */
+extern struct conf g_conf;
 
 static volatile sig_atomic_t g_doRespawn = 0;
 static volatile sig_atomic_t g_doReaping = 0;
+static volatile sig_atomic_t g_doDraining = 0;
 static volatile sig_atomic_t g_doShutdown = 0;
 
 static struct worker
 {
     wid_t w_id;
     int w_sfd;
+    int w_lfd;
     pid_t w_pid;
-} g_workers[WORKERS_CNT];
+    cpu_set_t w_cpus;
+    unsigned long w_passed; // connections passed, compared to s_received
+} *g_workers;
+
+/** Kinds of descriptors watched by a worker's epoll instance */
+enum conn_kind { CONN_IPC, CONN_LISTEN, CONN_CLIENT };
+
+/** What a client connection is given time for */
+enum conn_timeout { TIMEOUT_NONE, TIMEOUT_HEADER, TIMEOUT_IDLE, TIMEOUT_SEND };
+
+/** The state of the multishot recv of a connection (io_uring only) */
+enum conn_recv { RECV_OFF, RECV_ON, RECV_STOPPING };
+
+/** Per-connection state, attached to epoll events via data.ptr */
+struct conn
+{
+    int c_fd;
+    enum conn_kind c_kind;
+    enum conn_timeout c_timeout;
+    struct timer c_timer;
+    struct out_queue c_out;    // the unsent part of responses
+    int c_writing;             // waits for EPOLLOUT instead of EPOLLIN
+    int c_closing;             // closed as soon as c_out is drained
+    int c_backlog;             // counted in the backlog of the worker
+    int c_nodelay;             // TCP_NODELAY is set, once it is kept alive
+    unsigned long long c_acked; // by the client when TIMEOUT_SEND was armed
+    struct conn* c_prev;       // in the list of client connections
+    struct conn* c_next;
+    unsigned long c_started;   // when the request in work was read, in us
+    size_t c_len;              // bytes of pending requests in c_buf
+    struct http_parser c_parser; // the state of the request at c_buf
+    char c_peer[INET6_ADDRSTRLEN]; // for the access log
+    char c_buf[RECV_BUF_SIZE];
+
+    /* the io_uring engine only */
+    int c_inflight;            // submissions which have not completed yet
+    int c_dead;                // freed once c_inflight drops to zero
+    enum conn_recv c_recv;
+    char* c_spill;             // received data which does not fit c_buf
+    size_t c_spill_len;
+    struct msghdr c_msg;       // of the sendmsg in flight
+    struct iovec c_iov[OUT_IOV_MAX];
+    char* c_stage;             // file data of the send in flight
+    int c_stage_idx;           // its registered buffer, -1 if malloc'ed
+};
 
 static ssize_t
 sock_fd_write(int sock, void* buf, ssize_t buflen, int fd)
@@ -62,7 +141,7 @@ sock_fd_write(int sock, void* buf, ssize_t buflen, int fd)
     } else {
         msg.msg_control = NULL;
         msg.msg_controllen = 0;
-        printf("[worker] write: not passing fd\n");
+        debug_printf("[worker] write: not passing fd\n");
     }
 
     size = sendmsg(sock, &msg, 0);
@@ -138,93 +217,1225 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd)
     return size;
 }
 
+/** The load of a worker as seen by the server process: its connections,
+ *  the ones which wait for the socket to drain once more, and the ones
+ *  passed to it but not taken yet */
+static unsigned long
+worker_load(const struct stats_worker* w, const struct worker* wk)
+{
+    return __atomic_load_n(&w->s_active, __ATOMIC_RELAXED)
+        + __atomic_load_n(&w->s_backlog, __ATOMIC_RELAXED)
+        + (wk->w_passed - __atomic_load_n(&w->s_received, __ATOMIC_RELAXED));
+}
+
 static int
 get_vacant_worker_id()
 {
     static wid_t wid = 0;
-    return wid++ % WORKERS_CNT;
+    const struct stats_segment* seg = stats_shared();
+    unsigned long load;
+    unsigned long least;
+    int best;
+    int i;
+    int k;
+
+    best = wid++ % g_conf.nworkers;
+    if(DISPATCH_ROUND_ROBIN == g_conf.dispatch_mode || NULL == seg)
+        return best;
+
+    // a scan of a few cache lines; ties go round-robin from where the
+    // last scan has started
+    least = worker_load(&seg->s_workers[best], &g_workers[best]);
+    for(i = 1; i < g_conf.nworkers && 0 != least; ++i)
+    {
+        k = (best + i) % g_conf.nworkers;
+        if((load = worker_load(&seg->s_workers[k], &g_workers[k])) < least)
+        {
+            least = load;
+            best = k;
+        }
+    }
+    return best;
+}
+
+/** Timeouts of all client connections of the worker */
+static struct timer_wheel g_wheel;
+
+/** Client connections of the worker, for a drain to go through them */
+static struct conn* g_clients;
+
+/** Set once the server process has hung up the IPC socket: the worker
+ *  takes no new connections and exits when the ones it has are done */
+static int g_draining;
+static unsigned long g_drain_deadline;
+static int g_ipc_hangup;
+
+static unsigned long
+clock_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static unsigned long
+clock_ms()
+{
+    return clock_us() / 1000;
+}
+
+static struct conn*
+new_conn(int fd, enum conn_kind kind)
+{
+    struct conn* c = malloc(sizeof(*c));
+    if(NULL != c)
+    {
+        c->c_fd = fd;
+        c->c_kind = kind;
+        c->c_timeout = TIMEOUT_NONE;
+        timer_init(&c->c_timer, c);
+        out_init(&c->c_out);
+        c->c_writing = 0;
+        c->c_closing = 0;
+        c->c_backlog = 0;
+        c->c_nodelay = 0;
+        c->c_started = 0;
+        c->c_len = 0;
+        http_parser_reset(&c->c_parser);
+        c->c_inflight = 0;
+        c->c_dead = 0;
+        c->c_recv = RECV_OFF;
+        c->c_spill = NULL;
+        c->c_spill_len = 0;
+        c->c_stage = NULL;
+        c->c_stage_idx = -1;
+    }
+    else
+    {
+        perror("[worker] malloc for a connection failed");
+    }
+    return c;
+}
+
+static int
+watch_conn(int epfd, struct conn* c)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, c->c_fd, &ev))
+    {
+        perror("[worker] epoll_ctl(ADD)");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+set_events(int epfd, struct conn* c, unsigned int events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if(-1 == epoll_ctl(epfd, EPOLL_CTL_MOD, c->c_fd, &ev))
+    {
+        perror("[worker] epoll_ctl(MOD)");
+        return -1;
+    }
+    return 0;
+}
+
+/** The io_uring engine. Every submission made for a connection carries
+ *  a pointer to it with the kind of the operation in the low bits */
+enum uring_op { OP_NONE, OP_POLL, OP_ACCEPT, OP_RECV, OP_SEND, OP_READ };
+#define OP_MASK 7UL
+
+static struct uring g_ring;
+static struct uring_bufs g_rbufs;
+static char* g_stage;       // registered buffers, NULL if there are none
+static int g_stage_free[URING_STAGE_BUFS];
+static int g_nstage_free;
+
+static int
+uring_setup()
+{
+    struct iovec iov[URING_STAGE_BUFS];
+    int i;
+
+    if(-1 == uring_init(&g_ring, URING_ENTRIES))
+        return -1;
+    if(-1 == uring_bufs_init(&g_ring, &g_rbufs, 0, URING_RECV_BUFS,
+                RECV_BUF_SIZE))
+    {
+        uring_exit(&g_ring);
+        return -1;
+    }
+
+    if(NULL == (g_stage = malloc(URING_STAGE_BUFS * URING_STAGE_SIZE)))
+        return 0;
+    for(i = 0; i < URING_STAGE_BUFS; ++i)
+    {
+        iov[i].iov_base = g_stage + i * URING_STAGE_SIZE;
+        iov[i].iov_len = URING_STAGE_SIZE;
+        g_stage_free[i] = i;
+    }
+    if(0 != uring_register(&g_ring, IORING_REGISTER_BUFFERS, iov,
+                URING_STAGE_BUFS))
+    {
+        // e.g. RLIMIT_MEMLOCK, files are read into malloc'ed buffers then
+        perror("[worker] IORING_REGISTER_BUFFERS");
+        free(g_stage);
+        g_stage = NULL;
+        return 0;
+    }
+    g_nstage_free = URING_STAGE_BUFS;
+    return 0;
+}
+
+static struct io_uring_sqe*
+conn_sqe(struct conn* c, enum uring_op op)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&g_ring);
+
+    if(NULL != sqe)
+    {
+        sqe->user_data = (unsigned long) c | op;
+        ++c->c_inflight;
+    }
+    return sqe;
+}
+
+/** Starts the multishot operation which waits for input on the
+ *  descriptor, the counterpart of watch_conn() */
+static int
+uring_arm(struct conn* c)
+{
+    struct io_uring_sqe* sqe;
+
+    switch(c->c_kind)
+    {
+        case CONN_IPC:
+            if(NULL == (sqe = conn_sqe(c, OP_POLL)))
+                return -1;
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            break;
+        case CONN_LISTEN:
+            if(NULL == (sqe = conn_sqe(c, OP_ACCEPT)))
+                return -1;
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            break;
+        default:
+            if(NULL == (sqe = conn_sqe(c, OP_RECV)))
+                return -1;
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = g_rbufs.b_group;
+            c->c_recv = RECV_ON;
+    }
+    sqe->fd = c->c_fd;
+    return 0;
+}
+
+/** Pauses receiving while the client sends faster than it is served */
+static void
+uring_stop_recv(struct conn* c)
+{
+    struct io_uring_sqe* sqe;
+
+    if(RECV_ON == c->c_recv && NULL != (sqe = uring_sqe(&g_ring)))
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) c | OP_RECV;
+        c->c_recv = RECV_STOPPING;
+    }
+}
+
+static void
+release_stage(struct conn* c)
+{
+    if(-1 != c->c_stage_idx)
+        g_stage_free[g_nstage_free++] = c->c_stage_idx;
+    else
+        free(c->c_stage);
+    c->c_stage = NULL;
+    c->c_stage_idx = -1;
+}
+
+/** Submits a send of the head of the output queue. A file region is read
+ *  into a staging buffer by a request linked to the send, so both take
+ *  a single submission */
+static int
+uring_send(struct conn* c)
+{
+    struct io_uring_sqe* sqe;
+    int more;
+    int fd;
+    off_t offset;
+    size_t len;
+    unsigned int flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+    memset(&c->c_msg, 0, sizeof(c->c_msg));
+    c->c_msg.msg_iov = c->c_iov;
+    c->c_msg.msg_iovlen = out_peek_iov(&c->c_out, c->c_iov, OUT_IOV_MAX,
+            &more);
+    if(0 < c->c_msg.msg_iovlen)
+    {
+        if(NULL == (sqe = conn_sqe(c, OP_SEND)))
+            return -1;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->c_fd;
+        sqe->addr = (unsigned long) &c->c_msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags | (more ? MSG_MORE : 0);
+        return 0;
+    }
+
+    if(-1 == out_peek_file(&c->c_out, &fd, &offset, &len, &more))
+        return -1;
+    if(len > URING_STAGE_SIZE)
+    {
+        len = URING_STAGE_SIZE;
+        more = 1;
+    }
+    if(0 < g_nstage_free)
+    {
+        c->c_stage_idx = g_stage_free[--g_nstage_free];
+        c->c_stage = g_stage + c->c_stage_idx * URING_STAGE_SIZE;
+    }
+    else if(NULL == (c->c_stage = malloc(len)))
+    {
+        return -1;
+    }
+    if(-1 == uring_reserve(&g_ring, 2))
+    {
+        release_stage(c);
+        return -1;
+    }
+
+    sqe = conn_sqe(c, OP_READ);
+    sqe->opcode = (-1 != c->c_stage_idx) ? IORING_OP_READ_FIXED
+        : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) c->c_stage;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = (-1 != c->c_stage_idx) ? c->c_stage_idx : 0;
+    sqe->flags = IOSQE_IO_LINK; // a short read cancels the send
+
+    sqe = conn_sqe(c, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->c_fd;
+    sqe->addr = (unsigned long) c->c_stage;
+    sqe->len = len;
+    sqe->msg_flags = flags | (more ? MSG_MORE : 0);
+    return 0;
+}
+
+/** The counterpart of out_flush(): the queue is sent by one submission
+ *  at a time and the completion of the last one carries on */
+static int
+uring_flush(struct conn* c)
+{
+    if(out_empty(&c->c_out))
+        return 1;
+    if(c->c_writing)
+        return 0;
+    // the handler holds the cache entries the queue refers to
+    if(-1 == uring_send(c))
+        return -1;
+    c->c_writing = 1;
+    return 0;
+}
+
+static void
+finalize_conn(struct conn* c)
+{
+    struct io_uring_sqe* sqe;
+
+    out_clear(&c->c_out);
+    release_stage(c);
+    free(c->c_spill);
+    if(NULL != (sqe = uring_sqe(&g_ring)))
+    {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = c->c_fd;
+    }
+    else
+    {
+        close(c->c_fd);
+    }
+    free(c);
+}
+
+static void
+uring_close(struct conn* c)
+{
+    if(c->c_dead)
+        return;
+    c->c_dead = 1;
+    // completes the pending recv and send, the connection is freed after
+    shutdown(c->c_fd, SHUT_RDWR);
+    if(0 == c->c_inflight)
+        finalize_conn(c);
+}
+
+/** Bytes the client has acknowledged so far, 0 if the kernel does not
+ *  tell */
+static unsigned long long
+bytes_acked(int fd)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if(-1 == getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len)
+            || len < offsetof(struct tcp_info, tcpi_bytes_acked)
+                + sizeof(ti.tcpi_bytes_acked))
+        return 0;
+    return ti.tcpi_bytes_acked;
+}
+
+static void
+arm_timeout(struct conn* c, enum conn_timeout what)
+{
+    int sec;
+
+    switch(what)
+    {
+        case TIMEOUT_HEADER:
+            sec = g_conf.header_timeout_sec;
+            break;
+        case TIMEOUT_IDLE:
+            sec = g_conf.idle_timeout_sec;
+            break;
+        case TIMEOUT_SEND:
+            sec = g_conf.send_timeout_sec;
+            c->c_acked = bytes_acked(c->c_fd);
+            break;
+        default:
+            sec = 0;
+    }
+
+    c->c_timeout = what;
+    if(0 == sec)
+        timer_del(&g_wheel, &c->c_timer);
+    else
+        timer_add(&g_wheel, &c->c_timer, sec * 1000UL);
+}
+
+static void
+link_client(struct conn* c)
+{
+    c->c_prev = NULL;
+    c->c_next = g_clients;
+    if(NULL != g_clients)
+        g_clients->c_prev = c;
+    g_clients = c;
+}
+
+static void
+unlink_client(struct conn* c)
+{
+    if(NULL != c->c_prev)
+        c->c_prev->c_next = c->c_next;
+    else
+        g_clients = c->c_next;
+    if(NULL != c->c_next)
+        c->c_next->c_prev = c->c_prev;
+}
+
+static void
+close_conn(int epfd, struct conn* c)
+{
+    timer_del(&g_wheel, &c->c_timer);
+    unlink_client(c);
+    stats_closed();
+    if(c->c_backlog)
+        stats_backlog(-1);
+    if(ENGINE_URING == g_conf.engine)
+    {
+        uring_close(c);
+        return;
+    }
+    out_clear(&c->c_out);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->c_fd, NULL);
+    shutdown(c->c_fd, SHUT_WR);
+    close(c->c_fd);
+    free(c);
+}
+
+static void
+on_timeout(struct timer* t, void* arg)
+{
+    struct conn* c = t->t_data;
+
+    // a large send buffer drains for long without a write, so a client
+    // which is still taking data is given another period
+    if(TIMEOUT_SEND == c->c_timeout && bytes_acked(c->c_fd) != c->c_acked)
+    {
+        arm_timeout(c, TIMEOUT_SEND);
+        return;
+    }
+    debug_printf("[worker] socket %d timed out\n", c->c_fd);
+    close_conn(*(int*) arg, c);
+}
+
+/** Puts the address of the client into buf of INET6_ADDRSTRLEN bytes */
+static void
+peer_name(int fd, char* buf)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    const void* a = NULL;
+
+    if(0 == getpeername(fd, (struct sockaddr*) &addr, &len))
+    {
+        if(AF_INET == addr.ss_family)
+            a = &((struct sockaddr_in*) &addr)->sin_addr;
+        else if(AF_INET6 == addr.ss_family)
+            a = &((struct sockaddr_in6*) &addr)->sin6_addr;
+    }
+    if(NULL == a || NULL == inet_ntop(addr.ss_family, a, buf,
+                INET6_ADDRSTRLEN))
+    {
+        strcpy(buf, "-");
+    }
+}
+
+/** Takes a client socket, non-blocking one unless io_uring is used */
+static void
+add_client(int epfd, int fd)
+{
+    struct conn* client;
+
+    if(NULL == (client = new_conn(fd, CONN_CLIENT)))
+    {
+        close(fd);
+    }
+    else if(-1 == ((ENGINE_URING == g_conf.engine) ? uring_arm(client)
+                : watch_conn(epfd, client)))
+    {
+        close(fd);
+        free(client);
+    }
+    else
+    {
+        stats_accepted();
+        link_client(client);
+        if(g_conf.access_log_on)
+            peer_name(fd, client->c_peer);
+        arm_timeout(client, TIMEOUT_HEADER);
+    }
+}
+
+static void
+accept_clients(int epfd, int lfd)
+{
+    int fd;
+
+    while(-1 != (fd = accept4(lfd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)))
+    {
+        add_client(epfd, fd);
+    }
+    if(EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno
+            && ECONNABORTED != errno)
+    {
+        perror("[worker] accept4()");
+    }
+}
+
+static void
+accept_passed_fd(int epfd, int sock)
+{
+    int fd;
+    char c;
+    ssize_t s = sock_fd_read(sock, (void*) &c, 1, &fd);
+
+    if(0 == s)
+    {
+        // everything passed before has been read already
+        g_ipc_hangup = 1;
+        return;
+    }
+    if(s < 0)
+    {
+        if(EINTR != errno)
+        {
+            fprintf(stderr, "[worker] fd passing failed\n");
+        }
+        return;
+    }
+    if(-1 != fd)
+    {
+        stats_received();
+        if(ENGINE_EPOLL == g_conf.engine
+                && -1 == fcntl(fd, F_SETFL, O_NONBLOCK))
+        {
+            perror("[worker] fcntl(O_NONBLOCK)");
+            close(fd);
+            return;
+        }
+        add_client(epfd, fd);
+    }
+}
+
+/** Writes out queued responses. Returns 1 if everything has been sent,
+ *  0 if the rest waits for EPOLLOUT and -1 if the connection is broken */
+static int
+flush_output(int epfd, struct conn* c)
+{
+    int rv;
+
+    if(ENGINE_URING == g_conf.engine)
+        rv = uring_flush(c);
+    else
+        rv = out_flush(&c->c_out, c->c_fd);
+    stats_sent(c->c_out.o_sent);
+    c->c_out.o_sent = 0;
+    if((0 == rv) != c->c_backlog)
+    {
+        c->c_backlog = !c->c_backlog;
+        stats_backlog(c->c_backlog ? 1 : -1);
+    }
+    if(1 == rv && 0 != c->c_started)
+    {
+        stats_latency(clock_us() - c->c_started);
+        c->c_started = 0;
+    }
+
+    if(0 == rv && ENGINE_URING == g_conf.engine)
+    {
+        arm_timeout(c, TIMEOUT_SEND);
+    }
+    else if(0 == rv)
+    {
+        // the next response could evict what the queue refers to
+        if(-1 == out_pin(&c->c_out))
+            return -1;
+        if(!c->c_writing && -1 == set_events(epfd, c, EPOLLOUT))
+            return -1;
+        c->c_writing = 1;
+        arm_timeout(c, TIMEOUT_SEND);
+    }
+    else if(1 == rv && c->c_writing)
+    {
+        if(-1 == set_events(epfd, c, EPOLLIN))
+            return -1;
+        c->c_writing = 0;
+    }
+    else if(-1 == rv && EPIPE != errno && ECONNRESET != errno)
+    {
+        perror("[worker] send");
+    }
+    return rv;
+}
+
+/** Moves received data held back by the io_uring engine into c_buf */
+static void
+refill_buf(struct conn* c)
+{
+    size_t n = sizeof(c->c_buf) - c->c_len;
+
+    if(0 == c->c_spill_len)
+        return;
+    if(n > c->c_spill_len)
+        n = c->c_spill_len;
+    memcpy(c->c_buf + c->c_len, c->c_spill, n);
+    c->c_len += n;
+    c->c_spill_len -= n;
+    memmove(c->c_spill, c->c_spill + n, c->c_spill_len);
+
+    // a failure leaves the client to the timeouts
+    if(RECV_OFF == c->c_recv && SPILL_MAX > c->c_spill_len && !c->c_dead)
+        uring_arm(c);
+}
+
+/** A kept-alive connection waits for the next request after a response,
+ *  so Nagle would hold back its last segment until the delayed ACK */
+static void
+set_nodelay(struct conn* c)
+{
+    int on = 1;
+
+    if(-1 == setsockopt(c->c_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)))
+        perror("[worker] setsockopt(TCP_NODELAY)");
+    c->c_nodelay = 1;
+}
+
+/** Answers complete requests in the buffer, in order of arrival, until
+ *  a response does not fit into the socket. Returns 0 if the connection
+ *  has to be closed once the responses are sent and -1 if it is broken */
+static int
+process_requests(int epfd, struct conn* c)
+{
+    size_t reqlen;
+    size_t queued;
+    int code;
+    int keep_alive = 1;
+    int sent = 1;
+    enum parse_result rv = PARSE_AGAIN;
+
+    refill_buf(c);
+    while(keep_alive && 1 == sent && 0 < c->c_len)
+    {
+        rv = http_parse(&c->c_parser, c->c_buf, c->c_len);
+        if(PARSE_AGAIN == rv)
+        {
+            break;
+        }
+        c->c_started = clock_us();
+        queued = c->c_out.o_queued;
+        if(PARSE_ERROR == rv)
+        {
+            error_response(&c->c_out, BAD_REQUEST);
+            access_log(c->c_peer, NULL, 400, c->c_out.o_queued - queued);
+            keep_alive = 0;
+        }
+        else
+        {
+            keep_alive = make_response(&c->c_out, &c->c_parser, !g_draining,
+                    &code);
+            if(keep_alive && !c->c_nodelay)
+                set_nodelay(c);
+            access_log(c->c_peer, &c->c_parser, code,
+                    c->c_out.o_queued - queued);
+            c->c_timeout = TIMEOUT_NONE; // the next request gets its own time
+
+            reqlen = c->c_parser.pos;
+            c->c_len -= reqlen;
+            memmove(c->c_buf, c->c_buf + reqlen, c->c_len);
+            http_parser_reset(&c->c_parser);
+            refill_buf(c);
+        }
+        // pipelined responses share segments, the last one pushes them
+        if(keep_alive && 0 < c->c_len && ENGINE_EPOLL == g_conf.engine)
+            out_cork(&c->c_out, c->c_fd);
+        sent = flush_output(epfd, c);
+    }
+    if(ENGINE_EPOLL == g_conf.engine)
+        out_uncork(&c->c_out, c->c_fd);
+
+    if(keep_alive && 1 == sent && PARSE_AGAIN == rv
+            && c->c_len == sizeof(c->c_buf))
+    {
+        // the headers do not fit into the buffer
+        queued = c->c_out.o_queued;
+        error_response(&c->c_out, BAD_REQUEST);
+        access_log(c->c_peer, NULL, 400, c->c_out.o_queued - queued);
+        keep_alive = 0;
+        sent = flush_output(epfd, c);
+    }
+    return (-1 == sent) ? -1 : keep_alive;
+}
+
+/** Decides on the connection after process_requests() returned rv */
+static void
+update_conn(int epfd, struct conn* c, int rv)
+{
+    if(-1 == rv || (0 == rv && !c->c_writing))
+    {
+        close_conn(epfd, c);
+    }
+    else if(0 == rv)
+    {
+        c->c_closing = 1;
+    }
+    else if(!c->c_writing)
+    {
+        if(0 == c->c_len && g_draining)
+            close_conn(epfd, c);
+        else if(0 == c->c_len)
+            arm_timeout(c, TIMEOUT_IDLE);
+        else if(TIMEOUT_HEADER != c->c_timeout)
+            arm_timeout(c, TIMEOUT_HEADER);
+    }
 }
 
 static void
-worker_routine(int sock)
+serve_client(int epfd, struct conn* c)
+{
+    ssize_t bytes;
+    size_t room = sizeof(c->c_buf) - c->c_len;
+
+    if(0 < (bytes = recv(c->c_fd, (void*) (c->c_buf + c->c_len), room, 0)))
+    {
+        c->c_len += bytes;
+        update_conn(epfd, c, process_requests(epfd, c));
+        return;
+    }
+    else if(0 == bytes)
+    {
+        debug_printf("[worker] socket %d hung up\n", c->c_fd);
+    }
+    else if(EINTR == errno || EAGAIN == errno)
+    {
+        return;
+    }
+    else
+    {
+        perror("[worker] recv");
+    }
+    close_conn(epfd, c);
+}
+
+/** Resumes sending when the socket has room again */
+static void
+write_client(int epfd, struct conn* c)
+{
+    int rv = flush_output(epfd, c);
+
+    if(1 == rv)
+    {
+        // carry on with pipelined requests
+        rv = c->c_closing ? 0 : process_requests(epfd, c);
+    }
+    else if(0 == rv)
+    {
+        rv = 1;
+    }
+    update_conn(epfd, c, rv);
+}
+
+/** Copies received data to c_buf, or aside if it is full */
+static int
+take_data(struct conn* c, const char* data, size_t n)
+{
+    size_t room = sizeof(c->c_buf) - c->c_len;
+    char* spill;
+
+    if(0 == c->c_spill_len)
+    {
+        room = (n < room) ? n : room;
+        memcpy(c->c_buf + c->c_len, data, room);
+        c->c_len += room;
+        data += room;
+        n -= room;
+    }
+    if(0 < n)
+    {
+        if(NULL == (spill = realloc(c->c_spill, c->c_spill_len + n)))
+            return -1;
+        memcpy(spill + c->c_spill_len, data, n);
+        c->c_spill = spill;
+        c->c_spill_len += n;
+        if(SPILL_MAX <= c->c_spill_len)
+            uring_stop_recv(c);
+    }
+    return 0;
+}
+
+static void
+on_recv(struct conn* c, int res, unsigned int flags)
+{
+    unsigned int bid;
+    int rv = 0;
+
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(0 < res && !c->c_dead)
+            rv = take_data(c, uring_buf(&g_rbufs, bid), res);
+        uring_buf_recycle(&g_rbufs, bid);
+    }
+    if(!(flags & IORING_CQE_F_MORE))
+        c->c_recv = RECV_OFF;
+    if(c->c_dead)
+        return;
+
+    if(0 == res)
+    {
+        debug_printf("[worker] socket %d hung up\n", c->c_fd);
+        close_conn(-1, c);
+        return;
+    }
+    if(-1 == rv)
+    {
+        perror("[worker] realloc");
+        close_conn(-1, c);
+        return;
+    }
+    // out of receive buffers or paused on purpose
+    if(0 > res && -ENOBUFS != res && -ECANCELED != res)
+    {
+        errno = -res;
+        perror("[worker] recv");
+        close_conn(-1, c);
+        return;
+    }
+    if(RECV_OFF == c->c_recv && SPILL_MAX > c->c_spill_len
+            && -1 == uring_arm(c))
+    {
+        close_conn(-1, c);
+        return;
+    }
+    if(0 < res && !c->c_writing)
+        update_conn(-1, c, process_requests(-1, c));
+}
+
+static void
+on_sent(struct conn* c, int res)
+{
+    release_stage(c);
+    c->c_writing = 0;
+    if(c->c_dead)
+        return;
+
+    if(0 > res)
+    {
+        // -ECANCELED after the linked read of a file has failed
+        if(-EPIPE != res && -ECONNRESET != res && -ECANCELED != res)
+        {
+            errno = -res;
+            perror("[worker] send");
+        }
+        close_conn(-1, c);
+        return;
+    }
+    out_consume(&c->c_out, res);
+    write_client(-1, c);
+}
+
+static void
+uring_complete(unsigned long user_data, int res, unsigned int flags)
+{
+    struct conn* c = (struct conn*) (user_data & ~OP_MASK);
+
+    switch(user_data & OP_MASK)
+    {
+        case OP_POLL:
+            if(0 < res && !c->c_closing)
+            {
+                struct pollfd pfd = { .fd = c->c_fd, .events = POLLIN };
+
+                // a completion may stand for several descriptors passed
+                // since the last one
+                do
+                    accept_passed_fd(-1, c->c_fd);
+                while(!g_ipc_hangup && 1 == poll(&pfd, 1, 0));
+            }
+            break;
+        case OP_ACCEPT:
+            if(0 <= res)
+                add_client(-1, res);
+            else if(-EAGAIN != res && -ECONNABORTED != res
+                    && -ECANCELED != res)
+            {
+                errno = -res;
+                perror("[worker] accept");
+            }
+            break;
+        case OP_RECV:
+            on_recv(c, res, flags);
+            break;
+        case OP_READ:
+            if(0 > res && -ECANCELED != res)
+            {
+                errno = -res;
+                perror("[worker] read");
+            }
+            break;
+        case OP_SEND:
+            on_sent(c, res);
+            break;
+    }
+
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        if(0 == --c->c_inflight && c->c_dead)
+            finalize_conn(c);
+        else if(CONN_CLIENT != c->c_kind && !c->c_closing)
+            uring_arm(c); // the multishot request has ended
+    }
+}
+
+/** Stops the events of the IPC socket or of the listener */
+static void
+unwatch(int epfd, struct conn* c, enum uring_op op)
+{
+    struct io_uring_sqe* sqe;
+
+    if(ENGINE_EPOLL == g_conf.engine)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->c_fd, NULL);
+        return;
+    }
+    c->c_closing = 1; // the multishot request is not armed again
+    if(NULL != (sqe = uring_sqe(&g_ring)))
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) c | op;
+    }
+}
+
+/** Closes the listening socket of the worker once the connections queued
+ *  on it have been accepted. The last close takes an SO_REUSEPORT socket
+ *  out of its group, so a retired group gets no more connections, and
+ *  the queue is not reset. Returns non-zero once it is closed */
+static int
+close_listener(int epfd, struct conn* listener)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if(NULL == listener || -1 == listener->c_fd)
+        return 1;
+    if(!listener->c_closing)
+    {
+        // tcpi_unacked of a listening socket is the length of its accept
+        // queue
+        if(0 == getsockopt(listener->c_fd, IPPROTO_TCP, TCP_INFO, &ti, &len)
+                && 0 != ti.tcpi_unacked && clock_ms() < g_drain_deadline)
+            return 0;
+        unwatch(epfd, listener, OP_ACCEPT);
+        listener->c_closing = 1;
+    }
+    // the multishot accept keeps the socket in the group, and accepts,
+    // until its cancellation completes
+    if(0 != listener->c_inflight && clock_ms() < g_drain_deadline)
+        return 0;
+    close(listener->c_fd);
+    listener->c_fd = -1;
+    return 1;
+}
+
+/** Stops taking passed connections and closes the ones which wait for a
+ *  next request; the others are closed as soon as their responses are
+ *  sent. The listening socket is closed by close_listener() */
+static void
+start_drain(int epfd, struct conn* ipc)
+{
+    struct conn* c;
+    struct conn* next;
+
+    printf("[worker] Draining connections\n");
+    g_draining = 1;
+    g_drain_deadline = clock_ms() + g_conf.drain_timeout_sec * 1000UL;
+    unwatch(epfd, ipc, OP_POLL);
+
+    for(c = g_clients; NULL != c; c = next)
+    {
+        next = c->c_next;
+        if(TIMEOUT_IDLE == c->c_timeout)
+            close_conn(epfd, c);
+    }
+}
+
+/** Returns non-zero once the worker has drained after the server process
+ *  has hung up on it */
+static int
+is_drained(int epfd, struct conn* ipc, struct conn* listener)
+{
+    if(g_ipc_hangup && !g_draining)
+        start_drain(epfd, ipc);
+    if(!g_draining)
+        return 0;
+
+    if(close_listener(epfd, listener) && NULL == g_clients)
+    {
+        printf("[worker] Drained\n");
+        return 1;
+    }
+    if(clock_ms() >= g_drain_deadline)
+    {
+        printf("[worker] The drain has timed out, "
+                "closing the connections left\n");
+        return 1;
+    }
+    return 0;
+}
+
+/** A timeout for the wait for events; a draining worker looks at the
+ *  clock at least every DRAIN_CHECK_MS */
+static int
+wait_timeout()
+{
+    int timeout = timer_next_timeout(&g_wheel);
+
+    if(g_draining && (-1 == timeout || DRAIN_CHECK_MS < timeout))
+        timeout = DRAIN_CHECK_MS;
+    return timeout;
+}
+
+/** The worker loop of the io_uring engine. Receives, sends and closes of
+ *  all connections are queued while completions are handled and then
+ *  submitted together with a single io_uring_enter() */
+static void
+uring_routine(int sock, int lfd)
+{
+    int epfd = -1;
+    struct io_uring_cqe* cqe;
+    unsigned long user_data;
+    unsigned int flags;
+    int res;
+    struct conn* ipc;
+    struct conn* listener = NULL;
+
+    if(NULL == (ipc = new_conn(sock, CONN_IPC)) || -1 == uring_arm(ipc))
+    {
+        free(ipc);
+        return;
+    }
+    // the multishot accept waits on a blocking socket
+    if(-1 != lfd && (NULL == (listener = new_conn(lfd, CONN_LISTEN))
+                || -1 == fcntl(lfd, F_SETFL, 0) || -1 == uring_arm(listener)))
+    {
+        free(ipc);
+        free(listener);
+        return;
+    }
+
+    while(1)
+    {
+        if(-1 == uring_submit_and_wait(&g_ring, wait_timeout())
+                && EINTR != errno)
+        {
+            perror("[worker] io_uring_enter");
+            break;
+        }
+        timer_set_clock(&g_wheel, clock_ms());
+
+        while(NULL != (cqe = uring_peek_cqe(&g_ring)))
+        {
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&g_ring);
+            if(0 != user_data)
+                uring_complete(user_data, res, flags);
+        }
+        timer_expire(&g_wheel, on_timeout, &epfd);
+
+        if(0 != g_doShutdown)
+        {
+            printf("[worker] Shutdown requested\n");
+            break;
+        }
+        if(0 != is_drained(epfd, ipc, listener))
+        {
+            break;
+        }
+    }
+
+    free(ipc);
+    free(listener);
+    uring_exit(&g_ring);
+}
+
+static void
+raise_fd_limit()
+{
+    struct rlimit rl;
+
+    if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if(-1 == setrlimit(RLIMIT_NOFILE, &rl))
+        {
+            perror("[worker] setrlimit(RLIMIT_NOFILE)");
+        }
+    }
+}
+
+static void
+worker_routine(int sock, int lfd)
 {
     int i;
-    int bytes;
-    int fdmax = sock;
-    int status;
-    char buf[1024];
-    fd_set cache;
-    fd_set work;
+    int nev;
+    int epfd;
+    struct conn* ipc;
+    struct conn* listener = NULL;
+    struct epoll_event events[MAX_EVENTS];
 
-    FD_ZERO(&cache);
-    FD_SET(sock, &cache);
+    raise_fd_limit();
+    if(-1 == cache_init(g_conf.cache_max_mem, g_conf.cache_valid_sec))
+    {
+        fprintf(stderr, "[worker] The file cache is disabled\n");
+    }
+
+    timer_wheel_init(&g_wheel, clock_ms());
+    if(ENGINE_URING == g_conf.engine)
+    {
+        if(0 == uring_setup())
+        {
+            uring_routine(sock, lfd);
+            return;
+        }
+        fprintf(stderr, "[worker] io_uring is unavailable, "
+                "falling back to epoll\n");
+        g_conf.engine = ENGINE_EPOLL;
+    }
+    if(-1 == (epfd = epoll_create1(EPOLL_CLOEXEC)))
+    {
+        perror("[worker] epoll_create1");
+        return;
+    }
+    if(NULL == (ipc = new_conn(sock, CONN_IPC)) || -1 == watch_conn(epfd, ipc))
+    {
+        close(epfd);
+        return;
+    }
+    if(-1 != lfd && (NULL == (listener = new_conn(lfd, CONN_LISTEN))
+                || -1 == watch_conn(epfd, listener)))
+    {
+        close(epfd);
+        return;
+    }
 
     while(1)
     {
-        work = cache;
-        status = select(fdmax + 1, &work, NULL, NULL, NULL);
-        if(status > 0)
+        nev = epoll_wait(epfd, events, MAX_EVENTS, wait_timeout());
+        timer_set_clock(&g_wheel, clock_ms());
+        if(-1 == nev && EINTR != errno)
         {
-            for(i = 3; i <= fdmax; ++i)
-                if(FD_ISSET(i, &work))
-                {
-                    if(i != sock)
-                    {
-                        if(0 < (bytes = recv(i, (void*) buf, 1024, 0)))
-                        {
-                            shutdown(i, SHUT_RD);
-                            make_response(i, buf);
-                        }
-                        else
-                        {
-                            if(bytes == 0)
-                            {
-                                printf("[worker] socket %d hung up\n", i);
-                            }
-                            else if(EINTR != errno)
-                            {
-                                perror("[worker] recv");
-                            }
-                        }
-                        shutdown(i, SHUT_WR);
-                        close(i);
-                        FD_CLR(i, &cache);
-                    }
-                    else
-                    {
-                        int fd;
-                        char c;
-                        ssize_t s = sock_fd_read(sock, (void*) &c, 1, &fd);
-                        if(s <= 0)
-                        {
-                            if(EINTR != errno)
-                            {
-                                fprintf(stderr, "[worker] fd passing failed\n");
-                            }
-                        }
-                        else
-                        {
-                            FD_SET(fd, &cache);
-                            fdmax = (fdmax > fd) ? fdmax : fd;
-                        }
-                    }
-                }
+            perror("[worker] epoll_wait");
+            break;
         }
-        else if(-1 == status)
+
+        for(i = 0; i < nev; ++i)
         {
-            if(EINTR != errno)
+            struct conn* c = events[i].data.ptr;
+            switch(c->c_kind)
             {
-                perror("[worker] select");
-                break;
+                case CONN_IPC:
+                    accept_passed_fd(epfd, c->c_fd);
+                    break;
+                case CONN_LISTEN:
+                    accept_clients(epfd, c->c_fd);
+                    break;
+                case CONN_CLIENT:
+                    if(c->c_writing)
+                        write_client(epfd, c);
+                    else
+                        serve_client(epfd, c);
+                    break;
             }
         }
+        timer_expire(&g_wheel, on_timeout, &epfd);
 
         if(0 != g_doShutdown)
         {
             printf("[worker] Shutdown requested\n");
             break;
         }
+        if(0 != is_drained(epfd, ipc, listener))
+        {
+            break;
+        }
     }
+
+    free(ipc);
+    free(listener);
+    close(epfd);
 }
 
 static void
@@ -256,6 +1467,7 @@ setup_worker_ipc()
 static int
 new_worker(int wid)
 {
+    int i;
     int sfd[2];
     int status;
     pid_t pid;
@@ -271,17 +1483,45 @@ new_worker(int wid)
     {
         case 0:
             close(sfd[0]);
+            for(i = 0; i < g_conf.nworkers; ++i)
+            {
+                if(i != wid && -1 != g_workers[i].w_lfd)
+                    close(g_workers[i].w_lfd);
+                // or the others would not see the server hang up
+                if(-1 != g_workers[i].w_sfd)
+                    close(g_workers[i].w_sfd);
+            }
+            watch_close_inherited();
+            if(AFFINITY_OFF != g_conf.affinity)
+            {
+                pin_to_cpus(&g_workers[wid].w_cpus);
+            }
             setup_worker_ipc();
-            worker_routine(sfd[1]);
+            stats_attach(wid);
+            if(-1 == access_log_start())
+            {
+                fprintf(stderr, "[worker] The access log is disabled\n");
+            }
+            worker_routine(sfd[1], g_workers[wid].w_lfd);
+            access_log_stop();
             _exit(EXIT_SUCCESS);
         case -1:
             perror("[worker] fork failed while creating a new worker");
             return EXIT_FAILURE;
         default:
             close(sfd[1]);
+            if(-1 != g_workers[wid].w_sfd)
+                close(g_workers[wid].w_sfd); // of the dead predecessor
             g_workers[wid].w_id = wid;
             g_workers[wid].w_sfd = sfd[0];
             g_workers[wid].w_pid = pid;
+            // what the predecessor has not taken is gone with it
+            if(NULL != stats_shared())
+            {
+                g_workers[wid].w_passed = __atomic_load_n(
+                        &stats_shared()->s_workers[wid].s_received,
+                        __ATOMIC_RELAXED);
+            }
     }
     return wid;
 }
@@ -294,7 +1534,7 @@ respawn_worker()
 
     g_doRespawn = 0;
 
-    for(i = 0; i < WORKERS_CNT; ++i)
+    for(i = 0; i < g_conf.nworkers; ++i)
     {
         if(0 == (rv = waitpid(g_workers[i].w_pid, NULL, WNOHANG)))
         {
@@ -312,10 +1552,40 @@ void
 reap_workers()
 {
     int i;
-    for(i = 0; i < WORKERS_CNT; ++i)
+    for(i = 0; i < g_conf.nworkers; ++i)
+    {
+        if(0 < g_workers[i].w_pid)
+        {
+            kill(g_workers[i].w_pid, SIGTERM);
+            waitpid(g_workers[i].w_pid, NULL, 0);
+            g_workers[i].w_pid = -1;
+        }
+    }
+}
+
+void
+drain_workers()
+{
+    int i;
+
+    // a worker sees the hang-up after it has read the connections passed
+    // to it so far
+    for(i = 0; i < g_conf.nworkers; ++i)
+    {
+        close(g_workers[i].w_sfd);
+        g_workers[i].w_sfd = -1;
+    }
+    for(i = 0; i < g_conf.nworkers; ++i)
     {
-        kill(g_workers[i].w_pid, SIGTERM);
-        waitpid(g_workers[i].w_pid, NULL, 0);
+        while(-1 == waitpid(g_workers[i].w_pid, NULL, 0) && EINTR == errno)
+        {
+            if(is_reaping_needed())
+            {
+                reap_workers();
+                return;
+            }
+        }
+        g_workers[i].w_pid = -1;
     }
 }
 
@@ -343,10 +1613,22 @@ is_reaping_needed()
     return g_doReaping;
 }
 
+static void
+sig_worker_drain(int nsig)
+{
+    g_doDraining = nsig;
+}
+
+int
+is_draining_needed()
+{
+    return g_doDraining;
+}
+
 static void
 setup_master_ipc()
 {
-    struct sigaction sa_reap, sa_term;
+    struct sigaction sa_reap, sa_term, sa_drain;
     memset(&sa_reap, 0, sizeof(sa_reap));
     sa_reap.sa_handler = sig_worker_died;
     sigaction(SIGCHLD, &sa_reap, NULL);
@@ -355,13 +1637,47 @@ setup_master_ipc()
     sa_term.sa_handler = sig_worker_term;
     sigaction(SIGTERM, &sa_term, NULL);
     sigaction(SIGINT, &sa_term, NULL);
+
+    memset(&sa_drain, 0, sizeof(sa_drain));
+    sa_drain.sa_handler = sig_worker_drain;
+    sigaction(SIGQUIT, &sa_drain, NULL);
+}
+
+int
+prepare_workers(const int* lfds)
+{
+    int i;
+    cpu_set_t* sets;
+
+    g_workers = calloc(g_conf.nworkers, sizeof(*g_workers));
+    sets = malloc(g_conf.nworkers * sizeof(*sets));
+    if(NULL == g_workers || NULL == sets)
+    {
+        perror("[worker] calloc for the workers table failed");
+        free(sets);
+        return -1;
+    }
+
+    if(-1 == plan_cpu_affinity(sets, g_conf.nworkers, g_conf.affinity))
+    {
+        g_conf.affinity = AFFINITY_OFF;
+    }
+    for(i = 0; i < g_conf.nworkers; ++i)
+    {
+        g_workers[i].w_lfd = lfds[i];
+        g_workers[i].w_sfd = -1;
+        g_workers[i].w_pid = -1;
+        g_workers[i].w_cpus = sets[i];
+    }
+    free(sets);
+    return 0;
 }
 
 void
 init_workers()
 {
     int i;
-    for(i = 0; i < WORKERS_CNT; ++i)
+    for(i = 0; i < g_conf.nworkers; ++i)
     {
         new_worker(i);
     }
@@ -373,6 +1689,10 @@ int
 worker_fd_pass(int fd)
 {
     ssize_t size;
-    size = sock_fd_write(g_workers[get_vacant_worker_id()].w_sfd, "1", 1, fd);
+    int wid = get_vacant_worker_id();
+
+    size = sock_fd_write(g_workers[wid].w_sfd, "1", 1, fd);
+    if(0 < size)
+        ++g_workers[wid].w_passed;
     return size;
 }
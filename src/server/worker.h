@@ -7,12 +7,24 @@ respawn_worker();
 void
 reap_workers();
 
+// lets the workers finish their connections, see --drain-timeout
+void
+drain_workers();
+
 int
 is_respawn_needed();
 
 int
 is_reaping_needed();
 
+int
+is_draining_needed();
+
+// lfds[i] is a listening socket of the i-th worker or -1 if connections
+// are passed from the server process; it has to be called before chroot
+int
+prepare_workers(const int* lfds);
+
 void
 init_workers();
 
@@ -0,0 +1,668 @@
+/* Packs a document root into a single file which the server maps with
+ * --pack.
+ *
+ * Every regular file gets an entry under its path relative to the root,
+ * with the header lines the server would build for it and an ETag taken
+ * from its content, so an unchanged file keeps it across builds. Text files
+ * get a gzip variant if it is smaller, and "file.gz" and "file.br" sidecars
+ * become the variants of "file". The pack is written next to the output
+ * and renamed over it, so a reader never sees a half-written pack. */
+#define _GNU_SOURCE
+#include "server/compress.h"
+#include "server/mime.h"
+#include "server/pack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_MIME_TYPES "/etc/mime.types"
+#define DEF_GZIP_LEVEL 9
+/** Paths per bucket of the displacement table */
+#define PHF_LOAD 4
+#define PHF_MAX_TRIES (1U << 22)
+#define COPY_BUF_SIZE (64 * 1024)
+#define ETAG_LEN 24
+
+static const char * const ENCODING_HEADERS[PACK_NVARIANTS] = {
+    "Vary: Accept-Encoding\r\n",
+    "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n",
+    "Content-Encoding: br\r\nVary: Accept-Encoding\r\n"
+};
+
+struct variant
+{
+    uint64_t body;          // offset among the bodies
+    uint64_t size;
+    char etag[ETAG_LEN];
+};
+
+struct file
+{
+    char* path;             // relative to the root
+    const char* mimetype;
+    time_t mtime;
+    uint32_t variants;
+    struct variant v[PACK_NVARIANTS];
+    char* gzip;             // a gzip variant made here, NULL if none
+};
+
+static struct file* g_files;
+static size_t g_nfiles;
+static size_t g_maxfiles;
+static uint64_t g_bodies;   // bytes of bodies so far
+
+/** The string area of the pack, offsets are relative to its start */
+static char* g_strings;
+static size_t g_strings_len;
+static size_t g_strings_max;
+
+static void
+usage()
+{
+    printf(
+"Usage: sitepack [options] root pack\n"
+"-m path|off : A mime.types file (default: " DEF_MIME_TYPES ")\n"
+"-z 0-9      : gzip level of the variants made for text files, 0 makes\n"
+"              none (default: 9)\n"
+"-h          : Print help (this message) and exit\n");
+}
+
+static uint64_t
+hash_bytes(uint64_t h, const char* p, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char) p[i];
+        h *= 1099511628211ULL; // FNV-1a
+    }
+    return h;
+}
+
+#define HASH_START 14695981039346656037ULL
+
+static void
+format_etag(char* buf, uint64_t h)
+{
+    snprintf(buf, ETAG_LEN, "\"%016llx\"", (unsigned long long) h);
+}
+
+static uint32_t
+put_string(const char* s, size_t len)
+{
+    size_t off = g_strings_len;
+    char* p;
+
+    if(g_strings_len + len + 1 > g_strings_max)
+    {
+        g_strings_max = 2 * (g_strings_len + len + 1);
+        if(NULL == (p = realloc(g_strings, g_strings_max)))
+        {
+            perror("sitepack: realloc");
+            exit(EXIT_FAILURE);
+        }
+        g_strings = p;
+    }
+    memcpy(g_strings + off, s, len);
+    g_strings[off + len] = '\0';
+    g_strings_len += len + 1;
+    return off;
+}
+
+static struct file*
+new_file()
+{
+    struct file* f;
+
+    if(g_nfiles == g_maxfiles)
+    {
+        g_maxfiles = g_maxfiles ? 2 * g_maxfiles : 256;
+        if(NULL == (f = realloc(g_files, g_maxfiles * sizeof(*f))))
+        {
+            perror("sitepack: realloc");
+            exit(EXIT_FAILURE);
+        }
+        g_files = f;
+    }
+    f = &g_files[g_nfiles++];
+    memset(f, 0, sizeof(*f));
+    return f;
+}
+
+/** Reads the file for its ETag and makes its gzip variant */
+static int
+add_file(int dirfd, const char* name, const char* path, int level)
+{
+    char buf[COPY_BUF_SIZE];
+    struct stat st;
+    struct file* f;
+    uint64_t h = HASH_START;
+    off_t off = 0;
+    ssize_t n;
+    size_t len;
+    int fd;
+
+    if(-1 == (fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC))
+            || -1 == fstat(fd, &st))
+    {
+        fprintf(stderr, "sitepack: %s: %s\n", path, strerror(errno));
+        if(-1 != fd)
+            close(fd);
+        return -1;
+    }
+    while(0 < (n = read(fd, buf, sizeof(buf))))
+    {
+        h = hash_bytes(h, buf, n);
+        off += n;
+    }
+    if(-1 == n || off != st.st_size)
+    {
+        fprintf(stderr, "sitepack: %s: %s\n", path,
+                (-1 == n) ? strerror(errno) : "changed while packed");
+        close(fd);
+        return -1;
+    }
+
+    f = new_file();
+    if(NULL == (f->path = strdup(path)))
+    {
+        perror("sitepack: strdup");
+        exit(EXIT_FAILURE);
+    }
+    f->mimetype = mime_type(path);
+    f->mtime = st.st_mtime;
+    f->v[0].size = st.st_size;
+    format_etag(f->v[0].etag, h);
+
+    if(0 != level && mime_compressible(f->mimetype) && NULL != (f->gzip
+                = gzip_file(fd, NULL, st.st_size, level, &len)))
+    {
+        f->variants |= 1; // gzip
+        f->v[1].size = len;
+        format_etag(f->v[1].etag, hash_bytes(HASH_START, f->gzip, len));
+    }
+    close(fd);
+    return 0;
+}
+
+static int
+add_tree(int dirfd, const char* rel, int level)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    DIR* d;
+    int fd;
+    int rv = 0;
+
+    if(NULL == (d = fdopendir(dirfd)))
+    {
+        perror("sitepack: fdopendir");
+        close(dirfd);
+        return -1;
+    }
+    while(0 == rv && NULL != (de = readdir(d)))
+    {
+        if(0 == strcmp(de->d_name, ".") || 0 == strcmp(de->d_name, ".."))
+            continue;
+        if((size_t) snprintf(path, sizeof(path), "%s%s%s", rel,
+                    ('\0' != *rel) ? "/" : "", de->d_name) >= sizeof(path))
+        {
+            fprintf(stderr, "sitepack: %s...: the path is too long\n", path);
+            rv = -1;
+            break;
+        }
+        if(-1 == fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+        {
+            fprintf(stderr, "sitepack: %s: %s\n", path, strerror(errno));
+            rv = -1;
+            break;
+        }
+        if(S_ISDIR(st.st_mode))
+        {
+            fd = openat(dirfd, de->d_name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            rv = (-1 != fd) ? add_tree(fd, path, level) : -1;
+        }
+        else if(S_ISREG(st.st_mode))
+        {
+            rv = add_file(dirfd, de->d_name, path, level);
+        }
+        else
+        {
+            // the server does not follow symlinks out of the root either
+            fprintf(stderr, "sitepack: %s: not a regular file, skipped\n",
+                    path);
+        }
+    }
+    closedir(d);
+    return rv;
+}
+
+static int
+cmp_files(const void* a, const void* b)
+{
+    return strcmp(((const struct file*) a)->path,
+            ((const struct file*) b)->path);
+}
+
+static struct file*
+find_file(const char* path)
+{
+    struct file key;
+
+    key.path = (char*) path;
+    return bsearch(&key, g_files, g_nfiles, sizeof(*g_files), cmp_files);
+}
+
+/** Lays out the bodies in the order of the sorted files, followed by the
+ *  gzip variants made here, and makes "x.gz" and "x.br" the variants of
+ *  "x" with the bodies of the sidecars */
+static void
+place_bodies()
+{
+    static const char * const suffix[PACK_NVARIANTS] = {"", ".gz", ".br"};
+    char path[PATH_MAX];
+    struct file* f;
+    struct file* orig;
+    size_t len;
+    size_t i;
+    int enc;
+
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        g_files[i].v[0].body = g_bodies;
+        g_bodies += g_files[i].v[0].size;
+    }
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        f = &g_files[i];
+        len = strlen(f->path);
+        for(enc = 1; enc < PACK_NVARIANTS; ++enc)
+        {
+            if(len <= 3 || 0 != strcmp(f->path + len - 3, suffix[enc]))
+                continue;
+            memcpy(path, f->path, len - 3);
+            path[len - 3] = '\0';
+            if(NULL == (orig = find_file(path))
+                    || !mime_compressible(orig->mimetype))
+                continue;
+            // a sidecar is preferred to the variant made here
+            if(1 == enc && NULL != orig->gzip)
+            {
+                free(orig->gzip);
+                orig->gzip = NULL;
+            }
+            orig->variants |= enc;
+            orig->v[enc] = f->v[0];
+        }
+    }
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        if(NULL != g_files[i].gzip)
+        {
+            g_files[i].v[1].body = g_bodies;
+            g_bodies += g_files[i].v[1].size;
+        }
+    }
+}
+
+struct bucket
+{
+    uint32_t id;
+    uint32_t count;
+    uint32_t* files;
+};
+
+static int
+cmp_buckets(const void* a, const void* b)
+{
+    return (int) ((const struct bucket*) b)->count
+        - (int) ((const struct bucket*) a)->count;
+}
+
+/** Hash and displace: the paths of the biggest buckets are placed first,
+ *  each bucket gets the first displacement which puts all its paths into
+ *  free slots. Returns -1 if some bucket can not be placed. */
+static int
+build_phf(uint32_t nbuckets, uint32_t* disp, uint32_t* slots)
+{
+    struct bucket* b = calloc(nbuckets, sizeof(*b));
+    uint32_t* members = malloc((g_nfiles + 1) * sizeof(*members));
+    char* used = calloc(g_nfiles + 1, 1);
+    uint32_t* tried = malloc((g_nfiles + 1) * sizeof(*tried));
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    uint32_t d;
+    uint32_t at;
+    uint32_t s;
+    int rv = 0;
+
+    if(NULL == b || NULL == members || NULL == used || NULL == tried)
+    {
+        perror("sitepack: malloc");
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < g_nfiles; ++i)
+        ++b[pack_hash(g_files[i].path, strlen(g_files[i].path), 0)
+            % nbuckets].count;
+    for(i = 0, at = 0; i < nbuckets; ++i)
+    {
+        b[i].id = i;
+        b[i].files = members + at;
+        at += b[i].count;
+        b[i].count = 0;
+    }
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        j = pack_hash(g_files[i].path, strlen(g_files[i].path), 0)
+            % nbuckets;
+        b[j].files[b[j].count++] = i;
+    }
+    qsort(b, nbuckets, sizeof(*b), cmp_buckets);
+
+    memset(disp, 0, nbuckets * sizeof(*disp));
+    for(i = 0; i < nbuckets && 0 != b[i].count && 0 == rv; ++i)
+    {
+        for(d = 1; d < PHF_MAX_TRIES; ++d)
+        {
+            for(k = 0; k < b[i].count; ++k)
+            {
+                s = pack_hash(g_files[b[i].files[k]].path,
+                        strlen(g_files[b[i].files[k]].path), d) % g_nfiles;
+                if(used[s])
+                    break;
+                used[s] = 1;
+                tried[k] = s;
+            }
+            if(k == b[i].count)
+                break;
+            while(0 < k)
+                used[tried[--k]] = 0;
+        }
+        if(PHF_MAX_TRIES == d)
+        {
+            rv = -1;
+            break;
+        }
+        disp[b[i].id] = d;
+        for(k = 0; k < b[i].count; ++k)
+            slots[tried[k]] = b[i].files[k];
+    }
+    free(tried);
+    free(used);
+    free(members);
+    free(b);
+    return rv;
+}
+
+static int
+write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    ssize_t n;
+
+    while(0 < len)
+    {
+        if(-1 == (n = write(fd, p, len)))
+        {
+            if(EINTR == errno)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+copy_body(int out, int rootfd, const struct file* f)
+{
+    char buf[COPY_BUF_SIZE];
+    uint64_t left = f->v[0].size;
+    ssize_t n;
+    int fd;
+
+    if(-1 == (fd = openat(rootfd, f->path, O_RDONLY | O_CLOEXEC)))
+        return -1;
+    while(0 < left && 0 < (n = read(fd, buf,
+                    left < sizeof(buf) ? left : sizeof(buf))))
+    {
+        if(-1 == write_all(out, buf, n))
+        {
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    close(fd);
+    if(0 != left)
+    {
+        fprintf(stderr, "sitepack: %s: changed while packed\n", f->path);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+/** Puts the header lines of a representation into the string area */
+static void
+put_variant(struct pack_variant* pv, const struct file* f, int enc,
+            uint64_t strings)
+{
+    char header[512];
+    char date[64];
+    struct tm tm;
+    const struct variant* v = &f->v[enc];
+    int vlen;
+    int len;
+
+    gmtime_r(&f->mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    // as the file cache of the server builds them
+    vlen = snprintf(header, sizeof(header),
+            "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, date);
+    len = vlen + snprintf(header + vlen, sizeof(header) - vlen,
+            "Accept-Ranges: bytes\r\n%sContent-type: %s\r\n"
+            "Content-Length: %llu\r\n",
+            (0 != enc || mime_compressible(f->mimetype))
+                ? ENCODING_HEADERS[enc] : "",
+            f->mimetype, (unsigned long long) v->size);
+
+    pv->v_body = v->body;
+    pv->v_size = v->size;
+    pv->v_header = strings + put_string(header, len);
+    pv->v_header_len = len;
+    pv->v_validators_len = vlen;
+    pv->v_etag = strings + put_string(v->etag, strlen(v->etag));
+}
+
+static int
+write_pack(const char* root, const char* out)
+{
+    char tmp[PATH_MAX];
+    struct pack_header h;
+    struct pack_entry* entries;
+    uint32_t* disp;
+    uint32_t* slots;
+    uint64_t strings;
+    uint64_t bodies;
+    uint32_t nbuckets;
+    size_t i;
+    int enc;
+    int rootfd = -1;
+    int fd;
+
+    nbuckets = g_nfiles / PHF_LOAD + 1;
+    // room for the retries with more buckets
+    disp = malloc(4 * sizeof(*disp) * (size_t) nbuckets);
+    slots = malloc(4 * (g_nfiles + 1));
+    entries = calloc(g_nfiles + 1, sizeof(*entries));
+    if(NULL == disp || NULL == slots || NULL == entries)
+    {
+        perror("sitepack: malloc");
+        return -1;
+    }
+    // more and smaller buckets if the paths do not fit
+    while(-1 == build_phf(nbuckets, disp, slots))
+    {
+        if(nbuckets >= 4 * (g_nfiles / PHF_LOAD + 1))
+        {
+            fprintf(stderr, "sitepack: no perfect hash found\n");
+            return -1;
+        }
+        nbuckets *= 2;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.p_magic, PACK_MAGIC, 8);
+    h.p_count = g_nfiles;
+    h.p_nbuckets = nbuckets;
+    h.p_buckets = sizeof(h);
+    h.p_slots = h.p_buckets + 4ULL * nbuckets;
+    h.p_entries = (h.p_slots + 4ULL * g_nfiles + 7) & ~7ULL;
+    h.p_built = time(NULL);
+    strings = h.p_entries + g_nfiles * (uint64_t) sizeof(*entries);
+
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        entries[i].e_path = strings + put_string(g_files[i].path,
+                strlen(g_files[i].path));
+        entries[i].e_path_len = strlen(g_files[i].path);
+        entries[i].e_mimetype = strings + put_string(g_files[i].mimetype,
+                strlen(g_files[i].mimetype));
+        entries[i].e_variants = g_files[i].variants;
+        entries[i].e_mtime = g_files[i].mtime;
+    }
+    for(i = 0; i < g_nfiles; ++i)
+        for(enc = 0; enc < PACK_NVARIANTS; ++enc)
+            if(0 == enc || 0 != (g_files[i].variants & enc))
+                put_variant(&entries[i].e_v[enc], &g_files[i], enc, strings);
+    // the bodies follow the strings, which are only complete now
+    bodies = strings + g_strings_len;
+    if(bodies > UINT32_MAX)
+    {
+        fprintf(stderr, "sitepack: the index does not fit into 4 GiB\n");
+        return -1;
+    }
+    for(i = 0; i < g_nfiles; ++i)
+        for(enc = 0; enc < PACK_NVARIANTS; ++enc)
+            entries[i].e_v[enc].v_body += bodies;
+    h.p_size = bodies + g_bodies;
+
+    if((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp%ld", out, (long) getpid())
+            >= sizeof(tmp))
+    {
+        fprintf(stderr, "sitepack: %s: the name is too long\n", out);
+        return -1;
+    }
+    if(-1 == (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)))
+    {
+        fprintf(stderr, "sitepack: %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if(-1 == (rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+            || -1 == write_all(fd, &h, sizeof(h))
+            || -1 == write_all(fd, disp, 4ULL * nbuckets)
+            || -1 == write_all(fd, slots, 4ULL * g_nfiles)
+            || -1 == write_all(fd, "\0\0\0\0\0\0\0",
+                h.p_entries - h.p_slots - 4ULL * g_nfiles)
+            || -1 == write_all(fd, entries, g_nfiles * sizeof(*entries))
+            || -1 == write_all(fd, g_strings, g_strings_len))
+        goto fail;
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        if(-1 == copy_body(fd, rootfd, &g_files[i]))
+            goto fail;
+    }
+    for(i = 0; i < g_nfiles; ++i)
+    {
+        if(NULL != g_files[i].gzip && -1 == write_all(fd, g_files[i].gzip,
+                    g_files[i].v[1].size))
+            goto fail;
+    }
+    // a server reading the old pack keeps its mapping
+    if(-1 == fsync(fd))
+        goto fail;
+    close(fd);
+    fd = -1;
+    if(-1 == rename(tmp, out))
+        goto fail;
+    close(rootfd);
+    printf("sitepack: %zu files, %llu bytes in %s\n", g_nfiles,
+            (unsigned long long) h.p_size, out);
+    return 0;
+
+fail:
+    fprintf(stderr, "sitepack: %s: %s\n", out, strerror(errno));
+    if(-1 != fd)
+        close(fd);
+    if(-1 != rootfd)
+        close(rootfd);
+    unlink(tmp);
+    return -1;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* mime = DEF_MIME_TYPES;
+    int level = DEF_GZIP_LEVEL;
+    int opt;
+    int fd;
+
+    while(-1 != (opt = getopt(argc, argv, "m:z:h")))
+    {
+        switch(opt)
+        {
+            case 'm':
+                mime = (0 == strcmp(optarg, "off")) ? NULL : optarg;
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if(0 > level || 9 < level)
+                {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage();
+                return EXIT_SUCCESS;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+    if(2 != argc - optind)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    mime_load(mime);
+    if(-1 == (fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC)))
+    {
+        fprintf(stderr, "sitepack: %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if(-1 == add_tree(fd, "", level))
+        return EXIT_FAILURE;
+    qsort(g_files, g_nfiles, sizeof(*g_files), cmp_files);
+    place_bodies();
+    if(-1 == write_pack(argv[optind], argv[optind + 1]))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
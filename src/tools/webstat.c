@@ -0,0 +1,82 @@
+/* Prints the live counters of a running server.
+ *
+ * It maps the statistics segment of the server read-only, so it works
+ * even if no status URI is configured and never disturbs the workers. */
+#include "server/stats.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void
+usage()
+{
+    printf(
+"Usage: webstat [options]\n"
+"-j          : Print JSON instead of plain text\n"
+"-i seconds  : Print the counters again every so many seconds\n"
+"-h          : Print help (this message) and exit\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    const struct stats_segment* seg;
+    int json = 0;
+    int interval = 0;
+    int opt;
+    size_t size = 0;
+    size_t len;
+    char* buf = NULL;
+    char* p;
+
+    while(-1 != (opt = getopt(argc, argv, "ji:h")))
+    {
+        switch(opt)
+        {
+            case 'j':
+                json = 1;
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                return EXIT_SUCCESS;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(NULL == (seg = stats_open()))
+    {
+        fprintf(stderr, "webstat: no running server at " STATS_SHM_NAME "\n");
+        return EXIT_FAILURE;
+    }
+
+    while(1)
+    {
+        // the numbers keep growing, a report which did not fit is
+        // written again into a larger buffer
+        while(size <= (len = stats_format(seg, buf, size, json)))
+        {
+            size = len + 1024;
+            if(NULL == (p = realloc(buf, size)))
+            {
+                perror("webstat: realloc");
+                free(buf);
+                return EXIT_FAILURE;
+            }
+            buf = p;
+        }
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+        if(0 >= interval)
+            break;
+        sleep(interval);
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}